@@ -1,18 +1,23 @@
+#define _GNU_SOURCE
 #include <argp.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/ioctl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 
-#define XMG_MAGIC_CODE      'X'
-#define XMG_SET_BRIGHTNESS  _IOW(XMG_MAGIC_CODE, 0x00, int)
-#define XMG_SET_COLOR       _IOW(XMG_MAGIC_CODE, 0x01, int)
-#define XMG_SET_TIMEOUT     _IOW(XMG_MAGIC_CODE, 0x02, int)
-#define XMG_SET_BOOT        _IOW(XMG_MAGIC_CODE, 0x03, int)
+#include "xmg.h"
 
 
 const char *argp_program_version = "xmg_cli 1.0.1";
@@ -23,6 +28,10 @@ static struct argp_option options[] = {
     { "timeout", 't', "time", 0, "Set keyboard timeout" },
     { "boot-effect", 'o', 0, 0, "Overwrite keyboard boot effect" },
     { "restore", 'r', 0, 0, "Restore settings from file" },
+    { "daemon", 'd', 0, 0, "Keep device open and serve requests over Unix socket" },
+    { "status", 's', 0, 0, "Print statistics of running daemon" },
+    { "stream", 'S', "fps", OPTION_ARG_OPTIONAL, "Apply frames read from stdin at given rate (default: 30)" },
+    { "binary", 'B', 0, 0, "Stream frames in binary format (r, g, b, brightness bytes)" },
     { 0 }
 };
 
@@ -37,6 +46,10 @@ enum options_ids {
     OPTION_TIMEOUT,
     OPTION_BOOT_EFFECT,
     OPTION_RESTORE,
+    OPTION_DAEMON,
+    OPTION_STATUS,
+    OPTION_STREAM,
+    OPTION_BINARY,
 
     OPTION_MAX_ID
 };
@@ -46,10 +59,22 @@ struct arguments {
         int value;
     } args[OPTION_MAX_ID];
 };
+// Layout of settings file - independent of command line options
+enum settings_ids {
+    SETTING_BRIGHTNESS,
+    SETTING_COLOR,
+    SETTING_TIMEOUT,
+    SETTING_BOOT_EFFECT,
+    SETTING_RESERVED,           // Keeps files written by older versions valid
+
+    SETTING_MAX_ID
+};
 struct settings {
-    int value[OPTION_MAX_ID];
+    int value[SETTING_MAX_ID];
 };
 
+#define STREAM_DEFAULT_FPS      30
+
 static error_t parse_opt(int key, char* arg, struct argp_state *state) {
     struct arguments *arguments = state->input;
     int color_parts[3];
@@ -107,6 +132,30 @@ static error_t parse_opt(int key, char* arg, struct argp_state *state) {
             arguments->args[OPTION_RESTORE].state = SET_ABSOLUTE;
             arguments->args[OPTION_RESTORE].value = 1;
             break;
+
+        case 'd':
+            arguments->args[OPTION_DAEMON].state = SET_ABSOLUTE;
+            arguments->args[OPTION_DAEMON].value = 1;
+            break;
+
+        case 's':
+            arguments->args[OPTION_STATUS].state = SET_ABSOLUTE;
+            arguments->args[OPTION_STATUS].value = 1;
+            break;
+
+        case 'S':
+            arguments->args[OPTION_STREAM].state = SET_ABSOLUTE;
+            arguments->args[OPTION_STREAM].value = arg ? atoi(arg) : STREAM_DEFAULT_FPS;
+            if(arguments->args[OPTION_STREAM].value <= 0) {
+                fprintf(stderr, "Invalid stream rate\n");
+                return EINVAL;
+            }
+            break;
+
+        case 'B':
+            arguments->args[OPTION_BINARY].state = SET_ABSOLUTE;
+            arguments->args[OPTION_BINARY].value = 1;
+            break;
         
         case ARGP_KEY_ARG:
             return 0;
@@ -123,17 +172,21 @@ int read_settings_from_file(struct settings* out) {
     char path[120];
     snprintf(path, sizeof(path), "%s/.cache/.xmg_cli_settings.bin", getenv("HOME"));
     
-    int fd = open(path, 0);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
     if(fd < 0)
         return 1;
 
-    int ret = read(fd, out, sizeof(struct settings));
-    if(ret != sizeof(struct settings)) {
-        perror("read_settings_from_file - read");
+    // Don't leave partially read settings in `out`
+    struct settings settings;
+    int ret = read(fd, &settings, sizeof(settings));
+    close(fd);
+
+    if(ret != sizeof(settings)) {
+        fprintf(stderr, "read_settings_from_file - invalid settings file %s\n", path);
         return 1;
     }
 
-    close(fd);
+    *out = settings;
     return 0;
 }
 
@@ -150,11 +203,12 @@ int write_settings_to_file(struct settings* in) {
     int ret = write(fd, in, sizeof(struct settings));
     if(ret != sizeof(struct settings)) {
         perror("write_settings_to_file - write");
+        close(fd);
         return 1;
     }
 
     close(fd);
-    return 0;    
+    return 0;
 }
 
 
@@ -191,119 +245,688 @@ char* color_to_string(int color) {
 
 char* brightness_to_string(int brit) {
     char* string = malloc(30);
-    snprintf(string, 30, "%d", brit * 100 / 191);
+    snprintf(string, 30, "%d", brit * 100 / XMG_MAX_BRIGHTNESS);
     return string;
 }
 
 
-int main(int argc, char** argv) {
+// Settings file slot of every XMG_STATE_* field
+static const int setting_ids[XMG_STATE_FIELDS_COUNT] = {
+    [XMG_STATE_FIELD_BRIGHTNESS] = SETTING_BRIGHTNESS,
+    [XMG_STATE_FIELD_COLOR] = SETTING_COLOR,
+    [XMG_STATE_FIELD_TIMEOUT] = SETTING_TIMEOUT,
+    [XMG_STATE_FIELD_BOOT] = SETTING_BOOT_EFFECT,
+};
+
+// Copy fields selected by XMG_STATE_* mask
+void copy_settings_fields(struct settings* dst, const struct settings* src, unsigned int mask) {
+    for(int i = 0; i < XMG_STATE_FIELDS_COUNT; i++) {
+        if(mask & (1 << i))
+            dst->value[setting_ids[i]] = src->value[setting_ids[i]];
+    }
+}
+
+// Read settings file into `saved` on first use only
+const struct settings* load_saved_settings(struct settings* saved, bool* loaded) {
+    if(!*loaded) {
+        memset(saved, 0, sizeof(*saved));
+        read_settings_from_file(saved);
+        *loaded = true;
+    }
+    return saved;
+}
+
+/*
+ * Apply requested settings - `saved` holds contents of settings file (read
+ *  lazily unless `loaded` is set), `changed` tells whether the file needs to
+ *  be updated with resulting `settings`. The file is read only for --restore
+ *  or when driver doesn't know a field which the command needs.
+ *  On failure returns -1 with errno set and name of failed operation in `failed`
+ */
+int apply_arguments(struct xmg_handle* xmg, struct arguments* arguments, struct settings* saved,
+                    bool* loaded, struct settings* settings, bool* changed, const char** failed) {
+    *changed = false;
+    memset(settings, 0, sizeof(*settings));
+
+    // If started with option --restore, apply settings from file
+    if(arguments->args[OPTION_RESTORE].state != DISABLED) {
+        *settings = *load_saved_settings(saved, loaded);
+
+        struct xmg_state state = {
+            .mask = XMG_STATE_BRIGHTNESS | XMG_STATE_COLOR | XMG_STATE_TIMEOUT,
+            .brightness = settings->value[SETTING_BRIGHTNESS],
+            .color = settings->value[SETTING_COLOR],
+            .timeout = settings->value[SETTING_TIMEOUT],
+        };
+
+        if(settings->value[SETTING_BOOT_EFFECT]) {
+            state.mask |= XMG_STATE_BOOT;
+            state.boot = settings->value[SETTING_BOOT_EFFECT];
+        }
+
+        if(xmg_set_state(xmg, &state)) {
+            *failed = "ioctl settings restore";
+            return -1;
+        }
+        return 0;
+    }
+
+    // Relative changes are computed from the state held by the driver,
+    //  which also reflects changes made by other tools
+    struct xmg_state_info info;
+    if(xmg_get_state(xmg, &info))
+        info.mask = 0;
+
+    // Saved settings are used only for fields which the command needs (printed
+    //  brightness and color, current timeout for a relative change), but
+    //  driver doesn't know (not set since it was loaded or changed by hotkeys)
+    unsigned int needed = XMG_STATE_BRIGHTNESS | XMG_STATE_COLOR;
+    if(arguments->args[OPTION_TIMEOUT].state == SET_RELATIVE)
+        needed |= XMG_STATE_TIMEOUT;
+    if(needed & ~info.mask)
+        *settings = *load_saved_settings(saved, loaded);
+
+    if(info.mask & XMG_STATE_BRIGHTNESS)
+        settings->value[SETTING_BRIGHTNESS] = info.brightness;
+    if(info.mask & XMG_STATE_COLOR)
+        settings->value[SETTING_COLOR] = info.color;
+    if(info.mask & XMG_STATE_TIMEOUT)
+        settings->value[SETTING_TIMEOUT] = info.timeout;
+    if(info.mask & XMG_STATE_BOOT)
+        settings->value[SETTING_BOOT_EFFECT] = info.boot;
+    struct settings before = *settings;
+
+    // All fields are sent in a single XMG_SET_STATE call
+    struct xmg_state state = {0};
+
+    if(arguments->args[OPTION_BRIGHTNESS].state != DISABLED) {
+        int brightness;
+
+        if(arguments->args[OPTION_BRIGHTNESS].state == SET_ABSOLUTE)
+            brightness = arguments->args[OPTION_BRIGHTNESS].value;
+        else
+            brightness = settings->value[SETTING_BRIGHTNESS] + arguments->args[OPTION_BRIGHTNESS].value;
+        
+        if(brightness < 0) brightness = 0;
+        else if(brightness > XMG_MAX_BRIGHTNESS) brightness = XMG_MAX_BRIGHTNESS;
+
+        state.mask |= XMG_STATE_BRIGHTNESS;
+        state.brightness = brightness;
+    }
+
+    if(arguments->args[OPTION_COLOR].state != DISABLED) {
+        int color;
+
+        if(arguments->args[OPTION_COLOR].state == SET_ABSOLUTE)
+            color = arguments->args[OPTION_COLOR].value;
+        else {
+            int id = color_to_id(settings->value[SETTING_COLOR]);
+            id += arguments->args[OPTION_COLOR].value;
+            id %= (int)COLORS_COUNT;
+            if(id < 0) id = COLORS_COUNT + id;
+            color = colors[id].value;
+        }
+
+        state.mask |= XMG_STATE_COLOR;
+        state.color = color;
+    }
+
+    if(arguments->args[OPTION_TIMEOUT].state != DISABLED) {
+        int timeout;
+
+        if(arguments->args[OPTION_TIMEOUT].state == SET_ABSOLUTE)
+            timeout = arguments->args[OPTION_TIMEOUT].value;
+        else
+            timeout = settings->value[SETTING_TIMEOUT] + arguments->args[OPTION_TIMEOUT].value;
+        
+        if(timeout < 0) timeout = 0;
+        else if(timeout > XMG_MAX_TIMEOUT) timeout = XMG_MAX_TIMEOUT;
+
+        state.mask |= XMG_STATE_TIMEOUT;
+        state.timeout = timeout;
+    }
+
+    if(arguments->args[OPTION_BOOT_EFFECT].state != DISABLED) {
+        state.mask |= XMG_STATE_BOOT;
+        state.boot = 1;
+    }
+
+    if(state.mask && xmg_set_state(xmg, &state)) {
+        static const char* names[XMG_STATE_FIELDS_COUNT] = {
+            [XMG_STATE_FIELD_BRIGHTNESS] = "ioctl set brightness",
+            [XMG_STATE_FIELD_COLOR] = "ioctl set color",
+            [XMG_STATE_FIELD_TIMEOUT] = "ioctl set timeout",
+            [XMG_STATE_FIELD_BOOT] = "ioctl set boot",
+        };
+
+        // Report the first field rejected by the driver
+        *failed = "ioctl set state";
+        for(int i = 0; i < XMG_STATE_FIELDS_COUNT; i++) {
+            if((state.mask & (1 << i)) && state.result[i]) {
+                *failed = names[i];
+                errno = -state.result[i];
+                break;
+            }
+        }
+        return -1;
+    }
+
+    if(state.mask & XMG_STATE_BRIGHTNESS)
+        settings->value[SETTING_BRIGHTNESS] = state.brightness;
+    if(state.mask & XMG_STATE_COLOR)
+        settings->value[SETTING_COLOR] = state.color;
+    if(state.mask & XMG_STATE_TIMEOUT)
+        settings->value[SETTING_TIMEOUT] = state.timeout;
+    if(state.mask & XMG_STATE_BOOT)
+        settings->value[SETTING_BOOT_EFFECT] = 1;
+
+    // Settings file is needed only by --restore - rewrite it only when
+    //  some of the saved values differ. Without the file at hand, nothing
+    //  to save unless the request changed something
+    if(!*loaded) {
+        if(memcmp(settings, &before, sizeof(before)) == 0)
+            return 0;
+
+        // Complete fields which are neither known by driver nor set now
+        load_saved_settings(saved, loaded);
+        copy_settings_fields(settings, saved, XMG_STATE_ALL & ~(info.mask | state.mask));
+    }
+    *changed = memcmp(settings, saved, sizeof(*saved)) != 0;
+    return 0;
+}
+
+void print_settings(struct settings* settings) {
+    printf("[%s] %s%%\n", color_to_string(settings->value[SETTING_COLOR]), 
+                    brightness_to_string(settings->value[SETTING_BRIGHTNESS]));
+}
+
+
+/*
+ *	LATENCY STATISTICS
+ *  - percentiles cover last LATENCY_SAMPLES measurements
+ */
+#define LATENCY_SAMPLES         1024
+
+unsigned long long monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int compare_uint(const void* a, const void* b) {
+    unsigned int x = *(const unsigned int*)a, y = *(const unsigned int*)b;
+    return (x > y) - (x < y);
+}
+
+struct latency_samples {
+    unsigned int samples[LATENCY_SAMPLES];
+    unsigned long count;
+    unsigned int max_us;
+};
+
+void latency_record(struct latency_samples* latency, unsigned int us) {
+    latency->samples[latency->count++ % LATENCY_SAMPLES] = us;
+    if(us > latency->max_us)
+        latency->max_us = us;
+}
+
+void latency_percentiles(struct latency_samples* latency, unsigned int* p50, unsigned int* p99) {
+    static unsigned int sorted[LATENCY_SAMPLES];
+    unsigned long n = latency->count < LATENCY_SAMPLES ? latency->count : LATENCY_SAMPLES;
+
+    *p50 = *p99 = 0;
+    if(!n)
+        return;
+
+    memcpy(sorted, latency->samples, n * sizeof(sorted[0]));
+    qsort(sorted, n, sizeof(sorted[0]), compare_uint);
+    *p50 = sorted[n * 50 / 100];
+    *p99 = sorted[n * 99 / 100];
+}
+
+/*
+ *	DAEMON MODE
+ *  - daemon keeps the device open and serves requests of thin clients over
+ *    SOCK_SEQPACKET Unix socket, one request and one reply per connection
+ */
+#define DAEMON_SOCKET_NAME      "xmg_cli.sock"
+// First file descriptor passed by systemd socket activation
+#define SD_LISTEN_FDS_START     3
+// Requests are served one by one - don't let a stuck client block the others
+#define DAEMON_IO_TIMEOUT_MS    200
+
+enum daemon_request_type {
+    REQUEST_APPLY,
+    REQUEST_STATUS,
+};
+struct daemon_request {
+    int type;
     struct arguments arguments;
-    memset(&arguments, 0, sizeof(arguments));
+};
+struct daemon_stats {
+    unsigned long requests;
+    unsigned long errors;
+    // Latency of handling requests (from receive to reply) in microseconds,
+    //  percentiles cover last LATENCY_SAMPLES requests
+    unsigned int p50_us;
+    unsigned int p99_us;
+    unsigned int max_us;
+};
+struct daemon_reply {
+    int error;                          // errno of failed operation or 0
+    char failed[48];
+    struct settings settings;
+    struct daemon_stats stats;
+};
 
-    error_t error = argp_parse(&argp, argc, argv, 0, 0, &arguments);
-    if(error)
-        return 1;
-    
-    int xmg_fd = open("/dev/xmg_driver", 0);
-    if(xmg_fd < 0) {
+static volatile sig_atomic_t daemon_stop;
+
+static void daemon_signal(int sig) {
+    daemon_stop = 1;
+}
+
+int daemon_socket_path(struct sockaddr_un* addr) {
+    char fallback[64];
+    const char* dir = getenv("XDG_RUNTIME_DIR");
+
+    if(!dir) {
+        snprintf(fallback, sizeof(fallback), "/run/user/%u", getuid());
+        dir = fallback;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if(snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/%s", dir, DAEMON_SOCKET_NAME) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+// Socket passed by systemd (see sd_listen_fds(3)) or -1
+int daemon_activated_socket(void) {
+    const char* pid = getenv("LISTEN_PID");
+    const char* fds = getenv("LISTEN_FDS");
+
+    if(!pid || !fds || atoi(pid) != getpid() || atoi(fds) < 1)
+        return -1;
+
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    fcntl(SD_LISTEN_FDS_START, F_SETFD, FD_CLOEXEC);
+    return SD_LISTEN_FDS_START;
+}
+
+int run_daemon(void) {
+    struct sockaddr_un addr;
+    struct latency_samples latency = {0};
+    struct daemon_stats stats = {0};
+    struct settings saved;
+    bool loaded = false;
+    bool activated = true;
+
+    // Daemon is the only writer of settings file - keep its copy in memory
+    load_saved_settings(&saved, &loaded);
+
+    struct xmg_handle* xmg;
+    if(xmg_open(&xmg, NULL)) {
         perror("open /dev/xmg_driver failed");
         return 1;
     }
 
-    struct settings settings;
-    memset(&settings, 0, sizeof(settings));
-    read_settings_from_file(&settings);
-
-    // If started with option --restore, read settings from file and apply them
-    if(arguments.args[OPTION_RESTORE].state != DISABLED) {
-        int ret = ioctl(xmg_fd, XMG_SET_BRIGHTNESS, settings.value[OPTION_BRIGHTNESS]);
-        ret |= ioctl(xmg_fd, XMG_SET_COLOR, settings.value[OPTION_COLOR]);
-        ret |= ioctl(xmg_fd, XMG_SET_TIMEOUT, settings.value[OPTION_TIMEOUT]);
+    int listen_fd = daemon_activated_socket();
+    if(listen_fd < 0) {
+        activated = false;
+        if(daemon_socket_path(&addr)) {
+            perror("daemon - socket path");
+            return 1;
+        }
 
-        if(settings.value[OPTION_BOOT_EFFECT])
-            ret |= ioctl(xmg_fd, XMG_SET_BOOT, settings.value[OPTION_BOOT_EFFECT]);
+        listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if(listen_fd < 0) {
+            perror("daemon - socket");
+            return 1;
+        }
 
-        if(ret) {
-            perror("ioctl settings restore");
+        unlink(addr.sun_path);
+        if(bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(listen_fd, 16)) {
+            perror("daemon - bind");
             return 1;
         }
-    } else {
-        // Set brightness
-        if(arguments.args[OPTION_BRIGHTNESS].state != DISABLED) {
-            int brightness;
+    }
 
-            if(arguments.args[OPTION_BRIGHTNESS].state == SET_ABSOLUTE)
-                brightness = arguments.args[OPTION_BRIGHTNESS].value;
-            else
-                brightness = settings.value[OPTION_BRIGHTNESS] + arguments.args[OPTION_BRIGHTNESS].value;
-            
-            if(brightness < 0) brightness = 0;
-            else if(brightness > 191) brightness = 191;
+    // No SA_RESTART - let accept() return on signal
+    struct sigaction sa = { .sa_handler = daemon_signal };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    while(!daemon_stop) {
+        struct daemon_request request;
+        struct daemon_reply reply;
+        bool changed = false;
+
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if(fd < 0) {
+            if(errno != EINTR)
+                perror("daemon - accept");
+            continue;
+        }
 
-            int ret = ioctl(xmg_fd, XMG_SET_BRIGHTNESS, brightness);
-            if(ret) {
-                perror("ioctl set brightness");
-                return 1;
+        struct timeval timeout = {
+            .tv_sec = DAEMON_IO_TIMEOUT_MS / 1000,
+            .tv_usec = DAEMON_IO_TIMEOUT_MS % 1000 * 1000,
+        };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        unsigned long long start = monotonic_us();
+        memset(&reply, 0, sizeof(reply));
+
+        if(recv(fd, &request, sizeof(request), 0) != sizeof(request)) {
+            close(fd);
+            continue;
+        }
+
+        if(request.type == REQUEST_APPLY) {
+            const char* failed = NULL;
+
+            if(apply_arguments(xmg, &request.arguments, &saved, &loaded, &reply.settings, &changed, &failed)) {
+                reply.error = errno;
+                snprintf(reply.failed, sizeof(reply.failed), "%s", failed);
+                stats.errors++;
             }
-            settings.value[OPTION_BRIGHTNESS] = brightness;
+
+            stats.requests++;
+            latency_record(&latency, monotonic_us() - start);
         }
 
-        // Set color
-        if(arguments.args[OPTION_COLOR].state != DISABLED) {
-            int color;
+        latency_percentiles(&latency, &stats.p50_us, &stats.p99_us);
+        stats.max_us = latency.max_us;
+        reply.stats = stats;
+        send(fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+        close(fd);
 
-            if(arguments.args[OPTION_COLOR].state == SET_ABSOLUTE)
-                color = arguments.args[OPTION_COLOR].value;
+        // Keep file used by --restore up to date - after reply is sent
+        if(changed && write_settings_to_file(&reply.settings) == 0)
+            saved = reply.settings;
+    }
+
+    if(!activated)
+        unlink(addr.sun_path);
+    close(listen_fd);
+    xmg_close(xmg);
+    return 0;
+}
+
+/*
+ * Send request to running daemon - returns -1 if there is no daemon,
+ *  so caller should fall back to direct mode
+ */
+int daemon_call(struct daemon_request* request, struct daemon_reply* reply) {
+    struct sockaddr_un addr;
+
+    if(daemon_socket_path(&addr))
+        return -1;
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+        return -1;
+
+    if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) ||
+            send(fd, request, sizeof(*request), MSG_NOSIGNAL) != sizeof(*request) ||
+            recv(fd, reply, sizeof(*reply), 0) != sizeof(*reply)) {
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+    return 0;
+}
+
+
+/*
+ *	STREAM MODE
+ *  - frames read from stdin are applied at fixed rate, paced by timerfd.
+ *    Only the newest frame is applied on each tick, older ones are dropped.
+ *  - line format:      "rrr-ggg-bbb brightness\n"
+ *  - binary format:    4 bytes - r, g, b, brightness
+ */
+#define STREAM_BUFFER_SIZE      4096
+#define STREAM_BINARY_FRAME     4
+
+struct stream_frame {
+    int color;
+    int brightness;
+};
+
+struct stream_stats {
+    unsigned long received;
+    unsigned long applied;
+    unsigned long errors;
+    struct latency_samples latency;
+};
+
+static volatile sig_atomic_t stream_stop;
+
+static void stream_signal(int sig) {
+    stream_stop = 1;
+}
+
+// Parse complete frames from buffer - returns number of consumed bytes
+size_t stream_parse(char* buffer, size_t length, bool binary, struct stream_frame* frame,
+                    bool* pending, struct stream_stats* stats) {
+    size_t consumed = 0;
+    int r, g, b, brightness;
+
+    if(binary) {
+        for(; length - consumed >= STREAM_BINARY_FRAME; consumed += STREAM_BINARY_FRAME) {
+            unsigned char* raw = (unsigned char*)buffer + consumed;
+            frame->color = XMG_RGB_TO_COLOR(raw[0], raw[1], raw[2]);
+            frame->brightness = raw[3] > XMG_MAX_BRIGHTNESS ? XMG_MAX_BRIGHTNESS : raw[3];
+            *pending = true;
+            stats->received++;
+        }
+        return consumed;
+    }
+
+    char* line = buffer;
+    char* end;
+    while((end = memchr(line, '\n', length - consumed)) != NULL) {
+        *end = '\0';
+        if(sscanf(line, "%d-%d-%d %d", &r, &g, &b, &brightness) == 4) {
+            frame->color = XMG_RGB_TO_COLOR(r, g, b);
+            if(brightness < 0) brightness = 0;
+            else if(brightness > XMG_MAX_BRIGHTNESS) brightness = XMG_MAX_BRIGHTNESS;
+            frame->brightness = brightness;
+            *pending = true;
+            stats->received++;
+        } else if(*line)
+            fprintf(stderr, "stream - invalid frame: %s\n", line);
+
+        consumed += end - line + 1;
+        line = end + 1;
+    }
+
+    // Line longer than the whole buffer can't be ever completed
+    if(consumed == 0 && length == STREAM_BUFFER_SIZE) {
+        fprintf(stderr, "stream - frame too long\n");
+        return length;
+    }
+    return consumed;
+}
+
+void stream_apply(struct xmg_handle* xmg, struct stream_frame* frame, struct stream_frame* last,
+                  struct stream_stats* stats) {
+    unsigned long long start = monotonic_us();
+
+    // Don't spend ioctl on values which didn't change
+    if(frame->color != last->color) {
+        if(xmg_set_color(xmg, frame->color)) {
+            stats->errors++;
+            return;
+        }
+        last->color = frame->color;
+    }
+    if(frame->brightness != last->brightness) {
+        if(xmg_set_brightness(xmg, frame->brightness)) {
+            stats->errors++;
+            return;
+        }
+        last->brightness = frame->brightness;
+    }
+
+    stats->applied++;
+    latency_record(&stats->latency, monotonic_us() - start);
+}
+
+int run_stream(int fps, bool binary) {
+    static char buffer[STREAM_BUFFER_SIZE];
+    size_t length = 0;
+    struct stream_frame frame, last = { .color = -1, .brightness = -1 };
+    struct stream_stats stats = {0};
+    bool pending = false, eof = false;
+
+    struct xmg_handle* xmg;
+    if(xmg_open(&xmg, NULL)) {
+        perror("open /dev/xmg_driver failed");
+        return 1;
+    }
+
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if(timer_fd < 0) {
+        perror("stream - timerfd_create");
+        return 1;
+    }
+
+    long period_ns = 1000000000L / fps;
+    struct itimerspec period = {
+        .it_interval = { .tv_sec = period_ns / 1000000000L, .tv_nsec = period_ns % 1000000000L },
+        .it_value = { .tv_sec = period_ns / 1000000000L, .tv_nsec = period_ns % 1000000000L },
+    };
+    if(timerfd_settime(timer_fd, 0, &period, NULL)) {
+        perror("stream - timerfd_settime");
+        return 1;
+    }
+
+    struct sigaction sa = { .sa_handler = stream_signal };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    unsigned long long start = monotonic_us();
+    struct pollfd fds[2] = {
+        { .fd = STDIN_FILENO, .events = POLLIN },
+        { .fd = timer_fd, .events = POLLIN },
+    };
+
+    while(!stream_stop && !(eof && !pending)) {
+        // Stop reading stdin after EOF, but still apply the last frame
+        fds[0].fd = eof ? -1 : STDIN_FILENO;
+        if(poll(fds, 2, -1) < 0) {
+            if(errno == EINTR)
+                continue;
+            perror("stream - poll");
+            break;
+        }
+
+        if(fds[0].revents & (POLLIN | POLLHUP)) {
+            ssize_t ret = read(STDIN_FILENO, buffer + length, sizeof(buffer) - length);
+            if(ret <= 0)
+                eof = true;
             else {
-                int id = color_to_id(settings.value[OPTION_COLOR]);
-                id += arguments.args[OPTION_COLOR].value;
-                id %= (int)COLORS_COUNT;
-                if(id < 0) id = COLORS_COUNT + id;
-                color = colors[id].value;
+                length += ret;
+                size_t consumed = stream_parse(buffer, length, binary, &frame, &pending, &stats);
+                memmove(buffer, buffer + consumed, length - consumed);
+                length -= consumed;
             }
+        }
 
-            int ret = ioctl(xmg_fd, XMG_SET_COLOR, color);
-            if(ret) {
-                perror("ioctl set color");
-                return 1;
+        if(fds[1].revents & POLLIN) {
+            uint64_t expirations;
+            if(read(timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations) && pending) {
+                stream_apply(xmg, &frame, &last, &stats);
+                pending = false;
             }
-            settings.value[OPTION_COLOR] = color;
         }
+    }
 
-        // Set timeout
-        if(arguments.args[OPTION_TIMEOUT].state != DISABLED) {
-            int timeout;
+    double elapsed = (monotonic_us() - start) / 1000000.0;
+    unsigned int p50, p99;
+    latency_percentiles(&stats.latency, &p50, &p99);
 
-            if(arguments.args[OPTION_TIMEOUT].state == SET_ABSOLUTE)
-                timeout = arguments.args[OPTION_TIMEOUT].value;
-            else
-                timeout = settings.value[OPTION_TIMEOUT] + arguments.args[OPTION_TIMEOUT].value;
-            
-            if(timeout < 0) timeout = 0;
-            else if(timeout > 0xffff) timeout = 0xffff;
+    fprintf(stderr, "frames: %lu\napplied: %lu\ndropped: %lu\nerrors: %lu\nfps: %.1f\n"
+                    "latency_p50_us: %u\nlatency_p99_us: %u\nlatency_max_us: %u\n",
+        stats.received, stats.applied, stats.received - stats.applied - stats.errors, stats.errors,
+        elapsed > 0 ? stats.applied / elapsed : 0.0, p50, p99, stats.latency.max_us);
+
+    close(timer_fd);
+    xmg_close(xmg);
+    return 0;
+}
 
-            int ret = ioctl(xmg_fd, XMG_SET_TIMEOUT, timeout);
-            if(ret) {
-                perror("ioctl set timeout");
-                return 1;
-            }
 
-            settings.value[OPTION_TIMEOUT] = timeout;
+int main(int argc, char** argv) {
+    struct arguments arguments;
+    memset(&arguments, 0, sizeof(arguments));
+
+    error_t error = argp_parse(&argp, argc, argv, 0, 0, &arguments);
+    if(error)
+        return 1;
+
+    if(arguments.args[OPTION_DAEMON].state != DISABLED)
+        return run_daemon();
+
+    if(arguments.args[OPTION_STREAM].state != DISABLED)
+        return run_stream(arguments.args[OPTION_STREAM].value, arguments.args[OPTION_BINARY].state != DISABLED);
+
+    struct daemon_request request = { .type = REQUEST_APPLY, .arguments = arguments };
+    struct daemon_reply reply;
+
+    if(arguments.args[OPTION_STATUS].state != DISABLED) {
+        request.type = REQUEST_STATUS;
+        if(daemon_call(&request, &reply)) {
+            fprintf(stderr, "xmg_cli daemon is not running\n");
+            return 1;
         }
 
-        // Set boot effect
-        if(arguments.args[OPTION_BOOT_EFFECT].state != DISABLED) {
-            int ret = ioctl(xmg_fd, XMG_SET_BOOT, 1);
-            if(ret) {
-                perror("ioctl set boot");
-                return 1;
-            }
+        printf("requests: %lu\nerrors: %lu\nlatency_p50_us: %u\nlatency_p99_us: %u\nlatency_max_us: %u\n",
+            reply.stats.requests, reply.stats.errors, reply.stats.p50_us, reply.stats.p99_us, reply.stats.max_us);
+        return 0;
+    }
 
-            settings.value[OPTION_BOOT_EFFECT] = 1;
+    // Let the daemon do the work, if there is one
+    if(daemon_call(&request, &reply) == 0) {
+        if(reply.error) {
+            errno = reply.error;
+            perror(reply.failed);
+            return 1;
         }
+
+        print_settings(&reply.settings);
+        return 0;
+    }
+
+    struct xmg_handle* xmg;
+    if(xmg_open(&xmg, NULL)) {
+        perror("open /dev/xmg_driver failed");
+        return 1;
+    }
+
+    // Settings file is read only if the request needs it
+    struct settings saved, settings;
+    bool loaded = false, changed;
+    const char* failed;
+
+    if(apply_arguments(xmg, &arguments, &saved, &loaded, &settings, &changed, &failed)) {
+        perror(failed);
+        return 1;
     }
 
-    printf("[%s] %s%%\n", color_to_string(settings.value[OPTION_COLOR]), 
-                    brightness_to_string(settings.value[OPTION_BRIGHTNESS]));
-    write_settings_to_file(&settings);
+    print_settings(&settings);
+
+    // Settings file is needed only by --restore - update it only on change
+    if(changed)
+        write_settings_to_file(&settings);
+    xmg_close(xmg);
 }
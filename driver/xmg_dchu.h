@@ -0,0 +1,53 @@
+/*  
+ *  xmg_dchu.h - Encoding of keyboard commands sent via _DSM, shared
+ *          by the kernel module and libxmg fake backend
+ */
+#ifndef XMG_DCHU_H
+#define XMG_DCHU_H
+
+/*
+ *	MAGIC CODES USED BY _DSM
+ */
+#define KEYBOARD_DCHU_COMMAND       103
+#define KEYBOARD_DCHU_COMMAND_2     121
+
+#define KEYBOARD_COLOR_MAGIC        0xF0
+#define KEYBOARD_BRIGHTNESS_MAGIC   0xF4
+#define KEYBOARD_TIMEOUT_MAGIC      0x18
+#define KEYBOARD_BOOT_MAGIC         0x18
+
+#define FAN_DCHU_COMMAND_GET        12
+#define EVENT_DCHU_COMMAND_GET      1
+
+// Hotkey codes returned by EVENT_DCHU_COMMAND_GET
+#define KEYBOARD_EVENT_BRIGHTNESS_DOWN      0x81
+#define KEYBOARD_EVENT_BRIGHTNESS_UP        0x82
+#define KEYBOARD_EVENT_CYCLE_COLOR          0x83
+#define KEYBOARD_EVENT_CYCLE_BRIGHTNESS     0x8A
+#define KEYBOARD_EVENT_TOGGLE               0x9F
+
+/*
+ *	ENCODERS
+ *  - values must be validated by the caller, result is sent to the
+ *    keyboard controller as native 32-bit integer
+ */
+static inline int xmg_encode_brightness(int brightness) {
+    return (KEYBOARD_BRIGHTNESS_MAGIC << 24) | brightness;
+}
+
+static inline int xmg_encode_color(int color) {
+    return (KEYBOARD_COLOR_MAGIC << 24) | color;
+}
+
+static inline int xmg_encode_timeout(int timeout) {
+    // Negative timeout disables it
+    if(timeout < 0)
+        return KEYBOARD_TIMEOUT_MAGIC << 24;
+    return (KEYBOARD_TIMEOUT_MAGIC << 24) | (timeout << 8) | 0xFF;
+}
+
+static inline int xmg_encode_boot(int mode) {
+    return (KEYBOARD_BOOT_MAGIC << 24) | (!!mode);
+}
+
+#endif
@@ -4,6 +4,7 @@
  */
 #include <linux/acpi.h>
 #include <linux/capability.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
@@ -12,11 +13,42 @@
 #include <linux/platform_device.h>
 #include <linux/uaccess.h>
 #include <linux/hwmon.h>
-#include <linux/hwmon-sysfs.h>
+#include <linux/led-class-multicolor.h>
+#include <linux/jiffies.h>
+#include <linux/workqueue.h>
+#include <linux/spinlock.h>
+#include <linux/bitops.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/string.h>
+#include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/log2.h>
+#include <linux/seq_file.h>
+#include <linux/kref.h>
+#include <linux/rwsem.h>
+#include <linux/vmalloc.h>
+#include <linux/thermal.h>
+#include <linux/version.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/iio/iio.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/trigger_consumer.h>
+#include <linux/iio/triggered_buffer.h>
+#include <kunit/static_stub.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    #include <linux/io_uring/cmd.h>
+#else
+    #include <linux/io_uring.h>
+#endif
 
 
 #include "xmg_driver.h"
 
+#define CREATE_TRACE_POINTS
+#include "xmg_trace.h"
+
 #ifndef CONFIG_ACPI
     #error "CONFIG_ACPI is required by xmg_driver!"
 #endif
@@ -27,50 +59,130 @@ static const char DCHU_UUID[] = {
     0xad, 0xd6, 0xdb, 0x71, 0xbd, 0xc0, 0xaf, 0xad
 };
 
-static int xmg_acpi_call(struct device* dev, int cmd,
+static void xmg_data_release(struct kref* ref) {
+    kfree(container_of(ref, struct xmg_data, ref));
+}
+
+static void xmg_data_put(struct xmg_data* xmg) {
+    kref_put(&xmg->ref, xmg_data_release);
+}
+
+/*
+ * Build _DSM arguments which are common for all calls - done once at probe
+ */
+static int xmg_acpi_arena_init(struct xmg_data* xmg) {
+    int i;
+
+    xmg->acpi_packages = kcalloc(DSM_PACKAGES_COUNT, sizeof(union acpi_object), GFP_KERNEL);
+    if(!xmg->acpi_packages)
+        return -ENOMEM;
+
+    xmg->acpi_stats = vzalloc(XMG_STATS_COMMANDS * sizeof(struct xmg_cmd_stats));
+    if(!xmg->acpi_stats) {
+        kfree(xmg->acpi_packages);
+        return -ENOMEM;
+    }
+
+    mutex_init(&xmg->acpi_lock);
+    atomic_set(&xmg->acpi_contended, 0);
+
+    spin_lock_init(&xmg->fan_flight_lock);
+    init_waitqueue_head(&xmg->fan_flight_wq);
+    xmg->fan_inflight = false;
+    xmg->fan_flight_gen = 0;
+    atomic_set(&xmg->fan_shared, 0);
+
+    ACPI_SETUP_BUFFER(xmg->acpi_args[0], DCHU_UUID, sizeof(DCHU_UUID));
+    ACPI_SETUP_INTEGER(xmg->acpi_args[1], 0);
+    ACPI_SETUP_INTEGER(xmg->acpi_args[2], 0);
+
+    ACPI_SETUP_BUFFER(xmg->acpi_packages[0], xmg->acpi_small_buffer, DSM_MIN_BUFFER_SIZE);
+    for(i = 1; i < DSM_PACKAGES_COUNT; i++)
+        ACPI_SETUP_INTEGER(xmg->acpi_packages[i], 0);
+    ACPI_SETUP_PACKAGE(xmg->acpi_args[3], xmg->acpi_packages, DSM_PACKAGES_COUNT);
+
+    return 0;
+}
+
+static void xmg_acpi_arena_free(struct xmg_data* xmg) {
+    vfree(xmg->acpi_stats);
+    xmg->acpi_stats = NULL;
+    kfree(xmg->acpi_packages);
+    xmg->acpi_packages = NULL;
+}
+
+/*
+ * Account single _DSM evaluation - called with acpi_lock held
+ */
+static void xmg_acpi_stats_record(struct xmg_data* xmg, int cmd, u64 latency_ns, bool failed) {
+    struct xmg_cmd_stats* stats;
+    unsigned int bucket;
+
+    if(cmd < 0 || cmd >= XMG_STATS_COMMANDS - 1)
+        cmd = XMG_STATS_COMMANDS - 1;
+    stats = &xmg->acpi_stats[cmd];
+
+    bucket = latency_ns ? ilog2(latency_ns) : 0;
+    if(bucket >= XMG_STATS_BUCKETS)
+        bucket = XMG_STATS_BUCKETS - 1;
+
+    if(!stats->calls || latency_ns < stats->min_ns)
+        stats->min_ns = latency_ns;
+    if(latency_ns > stats->max_ns)
+        stats->max_ns = latency_ns;
+
+    stats->calls++;
+    stats->errors += failed;
+    stats->total_ns += latency_ns;
+    stats->histogram[bucket]++;
+}
+
+// Single place evaluating _DSM - replaced with a mock by KUnit suite
+static acpi_status xmg_acpi_evaluate(acpi_handle handle, struct acpi_object_list* args,
+            struct acpi_buffer* output) {
+    KUNIT_STATIC_STUB_REDIRECT(xmg_acpi_evaluate, handle, args, output);
+    return acpi_evaluate_object(handle, "_DSM", args, output);
+}
+
+// Must be called with acpi_lock held
+static int xmg_acpi_call_locked(struct device* dev, int cmd,
             char* buffer, size_t buffer_len, struct acpi_buffer* output) {
-    int i, ret = 0;
-    char stack_buffer[0x10] = {0};
+    int ret = 0;
+    struct xmg_data* xmg = dev_get_drvdata(dev);
+    u64 start, latency;
     
     acpi_status acpiStatus;
     struct acpi_object_list arg;
     struct acpi_buffer out_buffer = { ACPI_ALLOCATE_BUFFER, NULL };
-    union acpi_object* packages;
+
+    lockdep_assert_held(&xmg->acpi_lock);
 
     // Extend buffer to at least 0x10 bytes
-    if(buffer_len < 0x10) {
-        memcpy(stack_buffer, buffer, buffer_len);
-        buffer = stack_buffer;
-        buffer_len = 0x10;
+    if(buffer_len < DSM_MIN_BUFFER_SIZE) {
+        memset(xmg->acpi_small_buffer, 0, DSM_MIN_BUFFER_SIZE);
+        memcpy(xmg->acpi_small_buffer, buffer, buffer_len);
+        buffer = xmg->acpi_small_buffer;
+        buffer_len = DSM_MIN_BUFFER_SIZE;
     }
 
-    // Prepare acpi package
-    arg.count = 4;
-    arg.pointer = kmalloc(arg.count * sizeof(union acpi_object), GFP_KERNEL);
-    if(!arg.pointer) {
-        ret = -ENOMEM;
-        goto exit;
-    }
+    // Patch only per-call fields of preallocated package
+    ACPI_SETUP_INTEGER(xmg->acpi_args[2], cmd);
+    ACPI_SETUP_BUFFER(xmg->acpi_packages[0], buffer, buffer_len);
 
-    packages = kmalloc(0x104 * sizeof(union acpi_object), GFP_KERNEL);
-    if(!packages) {
-        ret = -ENOMEM;
-        goto arg_free;
-    }
+    arg.count = DSM_ARGS_COUNT;
+    arg.pointer = xmg->acpi_args;
 
-    ACPI_SETUP_BUFFER(arg.pointer[0], DCHU_UUID, sizeof(DCHU_UUID));
-    ACPI_SETUP_INTEGER(arg.pointer[1], 0);
-    ACPI_SETUP_INTEGER(arg.pointer[2], cmd);
+    trace_xmg_acpi_call_enter(cmd, buffer_len);
+    start = ktime_get_ns();
 
-    ACPI_SETUP_BUFFER(packages[0], buffer, buffer_len);
-    for(i = 1; i < 0x104; i++)
-        ACPI_SETUP_INTEGER(packages[i], 0);
-    ACPI_SETUP_PACKAGE(arg.pointer[3], packages, 0x104);
+    acpiStatus = xmg_acpi_evaluate(ACPI_HANDLE(dev), &arg, &out_buffer);
 
+    latency = ktime_get_ns() - start;
+    trace_xmg_acpi_call_exit(cmd, acpiStatus, latency);
+    xmg_acpi_stats_record(xmg, cmd, latency, ACPI_FAILURE(acpiStatus));
 
-    acpiStatus = acpi_evaluate_object(ACPI_HANDLE(dev), "_DSM", &arg, &out_buffer);
     if (ACPI_FAILURE(acpiStatus)) {
-        XMG_LOG_ERR(dev, "Cannot evaluate object - ACPI Error: %s", acpi_format_exception(acpiStatus));
+        XMG_LOG_ERR_RL(dev, "Cannot evaluate object - ACPI Error: %s", acpi_format_exception(acpiStatus));
         ret = -EFAULT;
     }
 
@@ -79,27 +191,61 @@ static int xmg_acpi_call(struct device* dev, int cmd,
     } else
         kfree(out_buffer.pointer);
 
-    kfree(packages);
-arg_free:
-    kfree(arg.pointer);
-exit:
+    return ret;
+}
+
+static int xmg_acpi_call(struct device* dev, int cmd,
+            char* buffer, size_t buffer_len, struct acpi_buffer* output) {
+    struct xmg_data* xmg = dev_get_drvdata(dev);
+    int ret;
+
+    // Count calls which have to wait for somebody else
+    if(!mutex_trylock(&xmg->acpi_lock)) {
+        atomic_inc(&xmg->acpi_contended);
+        mutex_lock(&xmg->acpi_lock);
+    }
+    ret = xmg_acpi_call_locked(dev, cmd, buffer, buffer_len, output);
+    mutex_unlock(&xmg->acpi_lock);
     return ret;
 }
 
 /*
  * KEYBOARD BACKLIGHT SUPPORT
  */
-static int xmg_driver_set_brightness(struct device* dev, int brightness) {
-    int ret = 0;
-    int enc_brightness;
-
+static int xmg_driver_check_brightness(struct device* dev, int brightness) {
     if(brightness < 0 || brightness > MAX_BRIGHTNESS_LEVEL) {
         XMG_LOG_ERR(dev, "Invalid brightness level (got: %d, expected 0-%d)",
             brightness, MAX_BRIGHTNESS_LEVEL);
         return -EINVAL;
     }
+    return 0;
+}
+
+static int xmg_driver_check_color(struct device* dev, int color) {
+    if(color & 0xff000000) {
+        XMG_LOG_ERR(dev, "Invalid color provided (got: %x, expected 0-0xffffff)", color);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int xmg_driver_check_timeout(struct device* dev, int timeout) {
+    if(timeout > XMG_MAX_TIMEOUT) {
+        XMG_LOG_ERR(dev, "Invalid timeout provided (got: %x, expected 0-0xffff)", timeout);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int xmg_driver_set_brightness(struct device* dev, int brightness) {
+    int ret = 0;
+    int enc_brightness;
+
+    ret = xmg_driver_check_brightness(dev, brightness);
+    if(ret)
+        return ret;
 
-    enc_brightness = (KEYBOARD_BRIGHTNESS_MAGIC << 24) | brightness;
+    enc_brightness = xmg_encode_brightness(brightness);
     ret = xmg_acpi_call(dev, KEYBOARD_DCHU_COMMAND, (char*)&enc_brightness, sizeof(enc_brightness), NULL);
     return ret;
 }
@@ -108,12 +254,11 @@ static int xmg_driver_set_color(struct device* dev, int color) {
     int ret = 0;
     int enc_color;
     
-    if(color & 0xff000000) {
-        XMG_LOG_ERR(dev, "Invalid color provided (got: %x, expected 0-0xffffff)", color);
-        return -EINVAL;
-    }
+    ret = xmg_driver_check_color(dev, color);
+    if(ret)
+        return ret;
 
-    enc_color = (KEYBOARD_COLOR_MAGIC << 24) | color;
+    enc_color = xmg_encode_color(color);
     ret = xmg_acpi_call(dev, KEYBOARD_DCHU_COMMAND, (char*)&enc_color, sizeof(enc_color), NULL);
     return ret;
 }
@@ -122,370 +267,2766 @@ static int xmg_driver_set_timeout(struct device* dev, int timeout) {
     int ret = 0;
     int enc_timeout;
 
-    if(timeout < 0) {
-        // Disable timeout
-        enc_timeout = KEYBOARD_TIMEOUT_MAGIC << 24;
-    } else if(timeout > 0xffff) {
-        XMG_LOG_ERR(dev, "Invalid timeout provided (got: %x, expected 0-0xffff)", timeout);
+    ret = xmg_driver_check_timeout(dev, timeout);
+    if(ret)
+        return ret;
+
+    enc_timeout = xmg_encode_timeout(timeout);
+
+    ret = xmg_acpi_call(dev, KEYBOARD_DCHU_COMMAND_2, (char*)&enc_timeout, sizeof(enc_timeout), NULL);
+    return ret;
+}
+
+static int xmg_driver_set_boot(struct device* dev, int mode) {
+    int ret = 0;
+    int enc_mode = xmg_encode_boot(mode);
+
+    ret = xmg_acpi_call(dev, KEYBOARD_DCHU_COMMAND_2, (char*)&enc_mode, sizeof(enc_mode), NULL);
+    return ret;
+}
+
+static int* xmg_state_field(struct xmg_state* state, enum xmg_state_field field) {
+    switch(field) {
+        case XMG_STATE_FIELD_BRIGHTNESS:    return &state->brightness;
+        case XMG_STATE_FIELD_COLOR:         return &state->color;
+        case XMG_STATE_FIELD_TIMEOUT:       return &state->timeout;
+        case XMG_STATE_FIELD_BOOT:          return &state->boot;
+        default:                            return NULL;
+    }
+}
+
+/*
+ * KNOWN HARDWARE STATE
+ *  - values which keyboard controller is known to hold, used to skip
+ *    redundant writes. Guarded by state_lock.
+ */
+#define XMG_WRITE_SKIPPED   1
+
+static int xmg_driver_write_field(struct xmg_data* xmg, enum xmg_state_field field, int value) {
+    struct device* dev = &xmg->pdev->dev;
+
+    switch(field) {
+        case XMG_STATE_FIELD_BRIGHTNESS:    return xmg_driver_set_brightness(dev, value);
+        case XMG_STATE_FIELD_COLOR:         return xmg_driver_set_color(dev, value);
+        case XMG_STATE_FIELD_TIMEOUT:       return xmg_driver_set_timeout(dev, value);
+        case XMG_STATE_FIELD_BOOT:          return xmg_driver_set_boot(dev, value);
+        default:                            return -EINVAL;
+    }
+}
+
+// Returns XMG_WRITE_SKIPPED if keyboard already holds requested value
+static int xmg_driver_write_hw(struct xmg_data* xmg, enum xmg_state_field field, int value, bool force) {
+    int ret;
+
+    lockdep_assert_held(&xmg->state_lock);
+
+    // Boot effect captures current settings - always write it
+    if(!force && field != XMG_STATE_FIELD_BOOT &&
+            test_bit(field, &xmg->hw_valid) && xmg->hw_values[field] == value)
+        return XMG_WRITE_SKIPPED;
+
+    ret = xmg_driver_write_field(xmg, field, value);
+    if(ret) {
+        clear_bit(field, &xmg->hw_valid);
+        return ret;
+    }
+
+    xmg->hw_values[field] = value;
+    set_bit(field, &xmg->hw_valid);
+    return 0;
+}
+
+// Forget known hardware state - keyboard may have been changed behind our back
+static void xmg_driver_invalidate_hw(struct xmg_data* xmg) {
+    mutex_lock(&xmg->state_lock);
+    xmg->hw_valid = 0;
+    mutex_unlock(&xmg->state_lock);
+}
+
+/*
+ * REMEMBERED STATE
+ *  - settings requested by users, restored after resume and reported by
+ *    XMG_GET_STATE. Published as a whole, so readers never see half of
+ *    a multi-field update.
+ */
+
+// Keep brightness and multi_intensity of LED class device in line with
+//  settings applied through any other interface
+static void xmg_led_sync_state(struct xmg_data* xmg, struct xmg_state_info* info, unsigned int mask) {
+#if IS_REACHABLE(CONFIG_LEDS_CLASS_MULTICOLOR)
+    struct mc_subled* subleds = xmg->led_subleds;
+    int hex, i;
+
+    if(mask & XMG_STATE_BRIGHTNESS)
+        WRITE_ONCE(xmg->led.led_cdev.brightness, info->brightness);
+
+    // Inverse of scaling in xmg_led_brightness_set - rounding makes sure
+    //  intensities written through LED class come back unchanged
+    if(mask & XMG_STATE_COLOR) {
+        hex = KEYBOARD_COLOR_TO_HEX(info->color);
+        for(i = 0; i < ARRAY_SIZE(xmg->led_subleds); i++)
+            WRITE_ONCE(subleds[i].intensity,
+                       DIV_ROUND_CLOSEST((hex >> (16 - 8 * i) & 0xff) * MAX_BRIGHTNESS_LEVEL, 0xff));
+    }
+#endif
+}
+
+static void xmg_driver_remember_state(struct xmg_data* xmg, struct xmg_state* state, unsigned int mask) {
+    struct xmg_state_info* info = &xmg->state_info;
+
+    lockdep_assert_held(&xmg->state_lock);
+
+    write_seqcount_begin(&xmg->state_seq);
+    if(mask & XMG_STATE_BRIGHTNESS)
+        info->brightness = state->brightness;
+    if(mask & XMG_STATE_COLOR)
+        info->color = state->color;
+    if(mask & XMG_STATE_TIMEOUT)
+        info->timeout = state->timeout;
+    if(mask & XMG_STATE_BOOT)
+        info->boot = !!state->boot;
+    info->mask |= mask;
+    info->generation++;
+    write_seqcount_end(&xmg->state_seq);
+
+    xmg_led_sync_state(xmg, info, mask);
+}
+
+/*
+ * Drop fields changed by firmware behind our back - their remembered values
+ *  are not restored anymore and writes of them can't be skipped
+ */
+static unsigned int xmg_driver_forget_state(struct xmg_data* xmg, unsigned int mask) {
+    struct xmg_state_info* info = &xmg->state_info;
+    unsigned int generation;
+
+    mutex_lock(&xmg->state_lock);
+    write_seqcount_begin(&xmg->state_seq);
+    info->mask &= ~mask;
+    generation = ++info->generation;
+    write_seqcount_end(&xmg->state_seq);
+
+    xmg->hw_valid &= ~(unsigned long)mask;
+    mutex_unlock(&xmg->state_lock);
+    return generation;
+}
+
+static void xmg_driver_get_state(struct xmg_data* xmg, struct xmg_state_info* info) {
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&xmg->state_seq);
+        *info = xmg->state_info;
+    } while(read_seqcount_retry(&xmg->state_seq, seq));
+}
+
+static int xmg_driver_check_state(struct xmg_data* xmg, struct xmg_state* state) {
+    struct device* dev = &xmg->pdev->dev;
+    int* result = state->result;
+
+    memset(state->result, 0, sizeof(state->result));
+
+    if(state->mask & ~(XMG_STATE_ALL | XMG_STATE_FORCE)) {
+        XMG_LOG_ERR(dev, "Invalid state mask (got: %x, expected: %x)", state->mask, XMG_STATE_ALL | XMG_STATE_FORCE);
         return -EINVAL;
-    } else {
-        // Set timeout to X sec.
-        enc_timeout = (KEYBOARD_TIMEOUT_MAGIC << 24) | (timeout << 8) | 0xFF;
     }
 
-    ret = xmg_acpi_call(dev, KEYBOARD_DCHU_COMMAND_2, (char*)&enc_timeout, sizeof(enc_timeout), NULL);
-    return ret;
+    if(state->mask & XMG_STATE_BRIGHTNESS)
+        result[XMG_STATE_FIELD_BRIGHTNESS] = xmg_driver_check_brightness(dev, state->brightness);
+    if(state->mask & XMG_STATE_COLOR)
+        result[XMG_STATE_FIELD_COLOR] = xmg_driver_check_color(dev, state->color);
+    if(state->mask & XMG_STATE_TIMEOUT)
+        result[XMG_STATE_FIELD_TIMEOUT] = xmg_driver_check_timeout(dev, state->timeout);
+
+    if(result[XMG_STATE_FIELD_BRIGHTNESS] || result[XMG_STATE_FIELD_COLOR] ||
+            result[XMG_STATE_FIELD_TIMEOUT])
+        return -EINVAL;
+    return 0;
+}
+
+/*
+ * Apply several keyboard settings in one go. All requested fields are
+ *  validated before any of them is sent to the keyboard controller.
+ *  Per-field status is reported in state->result, number of _DSM calls
+ *  actually issued (redundant writes excluded) in `issued`.
+ */
+static int xmg_driver_apply_state_counted(struct xmg_data* xmg, struct xmg_state* state,
+            unsigned int* issued) {
+    int ret = 0, field, value;
+    bool force = state->mask & XMG_STATE_FORCE;
+    unsigned int applied = 0;
+
+    *issued = 0;
+
+    ret = xmg_driver_check_state(xmg, state);
+    if(ret)
+        return ret;
+
+    atomic_inc(&xmg->keyboard_writers);
+    mutex_lock(&xmg->state_lock);
+
+    // Fields are ordered so that boot effect is written last, as it
+    //  captures current settings
+    for(field = 0; field < XMG_STATE_FIELDS_COUNT; field++) {
+        if(!(state->mask & BIT(field)))
+            continue;
+
+        value = *xmg_state_field(state, field);
+        state->result[field] = xmg_driver_write_hw(xmg, field, value, force);
+        if(state->result[field] == XMG_WRITE_SKIPPED) {
+            atomic_inc(&xmg->skipped_writes);
+            state->result[field] = 0;
+        } else if(state->result[field]) {
+            (*issued)++;
+            ret = ret ? : state->result[field];
+            continue;
+        } else {
+            (*issued)++;
+        }
+
+        applied |= BIT(field);
+    }
+
+    if(applied)
+        xmg_driver_remember_state(xmg, state, applied);
+    mutex_unlock(&xmg->state_lock);
+    atomic_dec(&xmg->keyboard_writers);
+    return ret;
+}
+
+static int xmg_driver_apply_state(struct xmg_data* xmg, struct xmg_state* state) {
+    unsigned int issued;
+
+    return xmg_driver_apply_state_counted(xmg, state, &issued);
+}
+
+// Wait for state changes queued by the driver itself (initial state after
+//  probe, restore after resume), so that user requests are applied on top
+static void xmg_driver_flush_pending(struct xmg_data* xmg) {
+    flush_work(&xmg->init_work);
+    flush_work(&xmg->restore_work);
+}
+
+/*
+ * ASYNCHRONOUS COMMAND QUEUE
+ */
+static unsigned int max_dsm_rate = 50;
+module_param(max_dsm_rate, uint, 0644);
+MODULE_PARM_DESC(max_dsm_rate, "Maximum number of _DSM calls per second issued by asynchronous queue (0 - unlimited)");
+
+/*
+ * Keyboard writes take precedence over sensor refreshes only in the sense
+ *  that no new refresh is started while they are pending - a _DSM call in
+ *  progress is never interrupted and acpi_lock is taken in arrival order
+ */
+static bool xmg_keyboard_busy(struct xmg_data* xmg) {
+    return READ_ONCE(xmg->async_pending) != 0 || atomic_read(&xmg->keyboard_writers) != 0;
+}
+
+/*
+ * Validate request and post it to the device workqueue. Fields already
+ *  waiting in the queue are overwritten - the latest value wins.
+ */
+static int xmg_async_queue_state(struct xmg_data* xmg, struct xmg_state* state) {
+    int ret, field;
+    unsigned long delay = 0;
+
+    ret = xmg_driver_check_state(xmg, state);
+    if(ret)
+        return ret;
+
+    spin_lock(&xmg->async_lock);
+    for(field = 0; field < XMG_STATE_FIELDS_COUNT; field++) {
+        if(!(state->mask & BIT(field)))
+            continue;
+
+        if(xmg->async_pending & BIT(field))
+            atomic_inc(&xmg->async_coalesced);
+
+        xmg->async_values[field] = *xmg_state_field(state, field);
+        xmg->async_pending |= BIT(field);
+    }
+    xmg->async_pending |= state->mask & XMG_STATE_FORCE;
+
+    if(time_before(jiffies, xmg->async_next_call))
+        delay = xmg->async_next_call - jiffies;
+    spin_unlock(&xmg->async_lock);
+
+    queue_delayed_work(xmg->wq, &xmg->async_work, delay);
+    return 0;
+}
+
+static int xmg_async_queue_field(struct xmg_data* xmg, enum xmg_state_field field, int value) {
+    struct xmg_state state = { .mask = BIT(field) };
+
+    *xmg_state_field(&state, field) = value;
+    return xmg_async_queue_state(xmg, &state);
+}
+
+static void xmg_async_work(struct work_struct* work) {
+    struct xmg_data* xmg = container_of(to_delayed_work(work), struct xmg_data, async_work);
+    struct xmg_state state = {0};
+    unsigned int rate = READ_ONCE(max_dsm_rate);
+    unsigned int issued;
+    int ret, field;
+
+    spin_lock(&xmg->async_lock);
+    state.mask = xmg->async_pending;
+    for(field = 0; field < XMG_STATE_FIELDS_COUNT; field++)
+        *xmg_state_field(&state, field) = xmg->async_values[field];
+    xmg->async_pending = 0;
+    spin_unlock(&xmg->async_lock);
+
+    if(!state.mask)
+        return;
+
+    ret = xmg_driver_apply_state_counted(xmg, &state, &issued);
+
+    spin_lock(&xmg->async_lock);
+    if(ret) {
+        for(field = 0; field < XMG_STATE_FIELDS_COUNT; field++)
+            if(state.result[field])
+                atomic_inc(&xmg->async_dropped);
+        xmg->async_error = ret;
+    }
+
+    // Charge only calls which reached the firmware
+    if(rate)
+        xmg->async_next_call = jiffies + DIV_ROUND_UP(issued * HZ, rate);
+    spin_unlock(&xmg->async_lock);
+}
+
+static int xmg_async_init(struct xmg_data* xmg) {
+    // Keyboard requests are interactive - run them from high priority workers
+    xmg->wq = alloc_ordered_workqueue("xmg_driver", WQ_HIGHPRI);
+    if(!xmg->wq)
+        return -ENOMEM;
+
+    spin_lock_init(&xmg->async_lock);
+    INIT_DELAYED_WORK(&xmg->async_work, xmg_async_work);
+    xmg->async_pending = 0;
+    xmg->async_next_call = jiffies;
+    xmg->async_error = 0;
+    atomic_set(&xmg->async_coalesced, 0);
+    atomic_set(&xmg->async_dropped, 0);
+    atomic_set(&xmg->keyboard_writers, 0);
+    return 0;
+}
+
+static void xmg_async_remove(struct xmg_data* xmg) {
+    // Apply whatever is still pending before going away
+    flush_delayed_work(&xmg->async_work);
+    destroy_workqueue(xmg->wq);
+}
+
+/*
+ * LIGHTING EFFECT ENGINE
+ */
+
+// Map transition progress (0 - 1024) using selected easing function
+static unsigned int xmg_effect_ease(unsigned int easing, unsigned int t) {
+    switch(easing) {
+        case XMG_EASING_LINEAR:
+            return t;
+        case XMG_EASING_IN_OUT:
+            return t * t * (3 * 1024 - 2 * t) / (1024 * 1024);
+        case XMG_EASING_STEP:
+        default:
+            return 0;
+    }
+}
+
+static int xmg_effect_lerp(int from, int to, unsigned int t) {
+    return from + (to - from) * (int)t / 1024;
+}
+
+// Interpolate each byte of BBRRGG color separately
+static int xmg_effect_lerp_color(int from, int to, unsigned int t) {
+    int shift, color = 0;
+
+    for(shift = 0; shift < 24; shift += 8)
+        color |= xmg_effect_lerp((from >> shift) & 0xff, (to >> shift) & 0xff, t) << shift;
+    return color;
+}
+
+static enum hrtimer_restart xmg_effect_timer_fn(struct hrtimer* timer) {
+    struct xmg_data* xmg = container_of(timer, struct xmg_data, effect_timer);
+
+    if(!READ_ONCE(xmg->effect_running))
+        return HRTIMER_NORESTART;
+
+    // Previous frame is still waiting for _DSM - skip this one
+    if(!queue_work(xmg->wq, &xmg->effect_work))
+        atomic_inc(&xmg->effect_skipped);
+
+    hrtimer_forward_now(timer, xmg->effect_period);
+    return HRTIMER_RESTART;
+}
+
+static void xmg_effect_work(struct work_struct* work) {
+    struct xmg_data* xmg = container_of(work, struct xmg_data, effect_work);
+    struct xmg_effect_frame *frame, *next;
+    unsigned int i, elapsed, start = 0, t;
+    int color, brightness;
+
+    mutex_lock(&xmg->effect_lock);
+    if(!xmg->effect_running) {
+        mutex_unlock(&xmg->effect_lock);
+        return;
+    }
+
+    // Position in effect is derived from time, so skipped frames don't slow it down
+    elapsed = ktime_ms_delta(ktime_get(), xmg->effect_start);
+    if(xmg->effect_flags & XMG_EFFECT_LOOP)
+        elapsed %= xmg->effect_length;
+    else if(elapsed >= xmg->effect_length) {
+        elapsed = xmg->effect_length - 1;
+        WRITE_ONCE(xmg->effect_running, false);
+    }
+
+    for(i = 0; i < xmg->effect_count - 1; i++) {
+        if(elapsed < start + xmg->effect_frames[i].duration)
+            break;
+        start += xmg->effect_frames[i].duration;
+    }
+
+    frame = &xmg->effect_frames[i];
+    if(i + 1 < xmg->effect_count)
+        next = &xmg->effect_frames[i + 1];
+    else if(xmg->effect_flags & XMG_EFFECT_LOOP)
+        next = &xmg->effect_frames[0];
+    else
+        next = frame;
+
+    t = min(elapsed - start, frame->duration) * 1024 / frame->duration;
+    t = xmg_effect_ease(frame->easing, t);
+    color = xmg_effect_lerp_color(frame->color, next->color, t);
+    brightness = xmg_effect_lerp(frame->brightness, next->brightness, t);
+    mutex_unlock(&xmg->effect_lock);
+
+    // Effect frames don't change remembered state - only the hardware one,
+    //  which also filters out frames identical to the previous ones
+    mutex_lock(&xmg->state_lock);
+    xmg_driver_write_hw(xmg, XMG_STATE_FIELD_BRIGHTNESS, brightness, false);
+    xmg_driver_write_hw(xmg, XMG_STATE_FIELD_COLOR, color, false);
+    mutex_unlock(&xmg->state_lock);
+}
+
+static void xmg_effect_start(struct xmg_data* xmg) {
+    xmg->effect_start = ktime_get();
+    WRITE_ONCE(xmg->effect_running, true);
+
+    hrtimer_start(&xmg->effect_timer, 0, HRTIMER_MODE_REL);
+}
+
+static void xmg_effect_stop(struct xmg_data* xmg) {
+    WRITE_ONCE(xmg->effect_running, false);
+    hrtimer_cancel(&xmg->effect_timer);
+    cancel_work_sync(&xmg->effect_work);
+}
+
+/*
+ * Replace running effect with the one provided by user (count == 0
+ *  just stops the engine)
+ */
+static int xmg_effect_upload(struct xmg_data* xmg, struct xmg_effect* effect) {
+    int ret = 0;
+    unsigned int i, length = 0;
+    unsigned int fps = effect->fps ? : XMG_EFFECT_DEFAULT_FPS;
+    struct device* dev = &xmg->pdev->dev;
+    struct xmg_effect_frame *frames = NULL, *old_frames;
+
+    if(effect->count > XMG_EFFECT_MAX_FRAMES || fps > XMG_EFFECT_MAX_FPS) {
+        XMG_LOG_ERR(dev, "Invalid effect (frames: %u, max: %d; fps: %u, max: %d)",
+            effect->count, XMG_EFFECT_MAX_FRAMES, fps, XMG_EFFECT_MAX_FPS);
+        return -EINVAL;
+    }
+
+    if(effect->count) {
+        frames = memdup_user(effect->frames, effect->count * sizeof(*frames));
+        if(IS_ERR(frames)) {
+            XMG_LOG_ERR(dev, "copy from user failed");
+            return PTR_ERR(frames);
+        }
+
+        for(i = 0; i < effect->count; i++) {
+            if(xmg_driver_check_color(dev, frames[i].color) ||
+                    xmg_driver_check_brightness(dev, frames[i].brightness) ||
+                    !frames[i].duration || frames[i].duration > 0xffff ||
+                    frames[i].easing >= XMG_EASING_COUNT) {
+                XMG_LOG_ERR(dev, "Invalid effect frame (%u)", i);
+                ret = -EINVAL;
+                goto frames_free;
+            }
+            length += frames[i].duration;
+        }
+    }
+
+    xmg_effect_stop(xmg);
+
+    mutex_lock(&xmg->effect_lock);
+    old_frames = xmg->effect_frames;
+    xmg->effect_frames = frames;
+    xmg->effect_count = effect->count;
+    xmg->effect_flags = effect->flags;
+    xmg->effect_length = length;
+    xmg->effect_period = ns_to_ktime(NSEC_PER_SEC / fps);
+    mutex_unlock(&xmg->effect_lock);
+
+    if(frames)
+        xmg_effect_start(xmg);
+
+    frames = old_frames;
+frames_free:
+    kfree(frames);
+    return ret;
+}
+
+static void xmg_effect_init(struct xmg_data* xmg) {
+    mutex_init(&xmg->effect_lock);
+    hrtimer_init(&xmg->effect_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    xmg->effect_timer.function = xmg_effect_timer_fn;
+    INIT_WORK(&xmg->effect_work, xmg_effect_work);
+    xmg->effect_frames = NULL;
+    xmg->effect_count = 0;
+    xmg->effect_running = false;
+    xmg->effect_suspended = false;
+    atomic_set(&xmg->effect_skipped, 0);
+}
+
+static void xmg_effect_remove(struct xmg_data* xmg) {
+    xmg_effect_stop(xmg);
+    kfree(xmg->effect_frames);
+    xmg->effect_frames = NULL;
+}
+
+/*
+ * LED CLASS SUPPORT
+ */
+#if IS_REACHABLE(CONFIG_LEDS_CLASS_MULTICOLOR)
+// Brightness remembered by the driver, unless it was changed by a hotkey since
+static enum led_brightness xmg_led_brightness_get(struct led_classdev* cdev) {
+    struct led_classdev_mc* mc_cdev = lcdev_to_mccdev(cdev);
+    struct xmg_data* xmg = container_of(mc_cdev, struct xmg_data, led);
+    struct xmg_state_info info;
+
+    xmg_driver_get_state(xmg, &info);
+    if(info.mask & XMG_STATE_BRIGHTNESS)
+        return info.brightness;
+    return READ_ONCE(cdev->brightness);
+}
+
+static int xmg_led_brightness_set(struct led_classdev* cdev, enum led_brightness brightness) {
+    struct led_classdev_mc* mc_cdev = lcdev_to_mccdev(cdev);
+    struct xmg_data* xmg = container_of(mc_cdev, struct xmg_data, led);
+    struct mc_subled* subleds = xmg->led_subleds;
+    struct xmg_state state = {
+        .mask = XMG_STATE_BRIGHTNESS | XMG_STATE_COLOR,
+        .brightness = brightness,
+    };
+
+    xmg_driver_flush_pending(xmg);
+
+    // Intensities are in range 0 - max_brightness - scale them to 8-bit channels
+    state.color = KEYBOARD_RGB_TO_COLOR(
+        subleds[0].intensity * 0xff / MAX_BRIGHTNESS_LEVEL,
+        subleds[1].intensity * 0xff / MAX_BRIGHTNESS_LEVEL,
+        subleds[2].intensity * 0xff / MAX_BRIGHTNESS_LEVEL);
+
+    return xmg_driver_apply_state(xmg, &state);
+}
+
+static int xmg_led_init(struct xmg_data* xmg) {
+    int i;
+    static const int LED_COLORS[] = { LED_COLOR_ID_RED, LED_COLOR_ID_GREEN, LED_COLOR_ID_BLUE };
+
+    for(i = 0; i < ARRAY_SIZE(LED_COLORS); i++) {
+        xmg->led_subleds[i].color_index = LED_COLORS[i];
+        xmg->led_subleds[i].intensity = MAX_BRIGHTNESS_LEVEL;
+        xmg->led_subleds[i].channel = i;
+    }
+
+    xmg->led.subled_info = xmg->led_subleds;
+    xmg->led.num_colors = ARRAY_SIZE(LED_COLORS);
+
+    xmg->led.led_cdev.name = "xmg::kbd_backlight";
+    xmg->led.led_cdev.max_brightness = MAX_BRIGHTNESS_LEVEL;
+    xmg->led.led_cdev.brightness_set_blocking = xmg_led_brightness_set;
+    xmg->led.led_cdev.brightness_get = xmg_led_brightness_get;
+    // LED_CORE_SUSPENDRESUME is deliberately not set - driver restores
+    //  keyboard state after resume on its own. Keyboard is not switched
+    //  off on shutdown either, so it keeps the user's setting until firmware
+    //  applies the boot effect
+    xmg->led.led_cdev.flags = LED_RETAIN_AT_SHUTDOWN;
+
+    return led_classdev_multicolor_register(&xmg->pdev->dev, &xmg->led);
+}
+
+static void xmg_led_remove(struct xmg_data* xmg) {
+    led_classdev_multicolor_unregister(&xmg->led);
+}
+#else
+static int xmg_led_init(struct xmg_data* xmg) {
+    return 0;
+}
+
+static void xmg_led_remove(struct xmg_data* xmg) {
+}
+#endif
+
+/*
+ * STATE RESTORE
+ */
+
+// Keyboard loses its settings after each suspend - send remembered ones again
+static void xmg_restore_work(struct work_struct* work) {
+    struct xmg_data* xmg = container_of(work, struct xmg_data, restore_work);
+    struct device* dev = &xmg->pdev->dev;
+    struct xmg_state_info info;
+    struct xmg_state state;
+    int ret;
+
+    xmg_driver_get_state(xmg, &info);
+    state = (struct xmg_state) {
+        .mask = (info.mask & (XMG_STATE_BRIGHTNESS | XMG_STATE_COLOR | XMG_STATE_TIMEOUT)) |
+                XMG_STATE_FORCE,
+        .brightness = info.brightness,
+        .color = info.color,
+        .timeout = info.timeout,
+    };
+
+    xmg_driver_invalidate_hw(xmg);
+
+    if(state.mask & XMG_STATE_ALL) {
+        ret = xmg_driver_apply_state(xmg, &state);
+        if(ret)
+            XMG_LOG_ERR(dev, "failed to restore keyboard state after resume (err: %d)", ret);
+    }
+
+    if(xmg->effect_suspended) {
+        xmg->effect_suspended = false;
+        xmg_effect_start(xmg);
+    }
+
+    WRITE_ONCE(xmg->resume_latency_us, ktime_us_delta(ktime_get(), xmg->resume_time));
+    XMG_LOG_INFO(dev, "restored keyboard state after resume");
+}
+
+/*
+ * INITIAL STATE
+ *  - keyboard settings given as module parameters are applied from a work
+ *    item after probe, so that ACPI calls don't delay boot
+ */
+static int initial_brightness = -1;
+module_param(initial_brightness, int, 0444);
+MODULE_PARM_DESC(initial_brightness, "Keyboard brightness set after load (0 - 191, -1 - keep firmware default)");
+
+static int initial_color = -1;
+module_param(initial_color, int, 0444);
+MODULE_PARM_DESC(initial_color, "Keyboard color set after load as 0xRRGGBB (-1 - keep firmware default)");
+
+static int initial_timeout = -1;
+module_param(initial_timeout, int, 0444);
+MODULE_PARM_DESC(initial_timeout, "Keyboard timeout set after load (0 - 65535, -1 - keep firmware default)");
+
+static bool initial_boot;
+module_param(initial_boot, bool, 0444);
+MODULE_PARM_DESC(initial_boot, "Overwrite boot effect with initial settings");
+
+static void xmg_init_work(struct work_struct* work) {
+    struct xmg_data* xmg = container_of(work, struct xmg_data, init_work);
+    struct device* dev = &xmg->pdev->dev;
+    struct xmg_state state = {0};
+    int ret;
+
+    if(initial_brightness >= 0) {
+        state.mask |= XMG_STATE_BRIGHTNESS;
+        state.brightness = initial_brightness;
+    }
+    if(initial_color > 0xffffff) {
+        XMG_LOG_ERR(dev, "Invalid initial_color provided (got: %x, expected 0-0xffffff)", initial_color);
+    } else if(initial_color >= 0) {
+        state.mask |= XMG_STATE_COLOR;
+        state.color = KEYBOARD_COLOR_FROM_HEX(initial_color);
+    }
+    if(initial_timeout >= 0) {
+        state.mask |= XMG_STATE_TIMEOUT;
+        state.timeout = initial_timeout;
+    }
+    if(initial_boot) {
+        state.mask |= XMG_STATE_BOOT;
+        state.boot = 1;
+    }
+
+    if(!state.mask)
+        return;
+
+    ret = xmg_driver_apply_state(xmg, &state);
+    if(ret) {
+        XMG_LOG_ERR(dev, "failed to apply initial keyboard state (err: %d)", ret);
+        return;
+    }
+
+    WRITE_ONCE(xmg->init_latency_us, ktime_us_delta(ktime_get(), xmg->probe_time));
+    XMG_LOG_INFO(dev, "applied initial keyboard state");
+}
+
+/*
+ * HOTKEY EVENTS
+ *  - firmware notifies the device when keyboard hotkey was pressed, code
+ *    of the hotkey is fetched with EVENT_DCHU_COMMAND_GET
+ */
+static int xmg_event_fetch(struct device* dev, unsigned int* code) {
+    int ret = 0;
+    char empty_input[0x10] = {0};
+    union acpi_object* acpi_obj;
+    struct acpi_buffer acpi_output = {0};
+
+    ret = xmg_acpi_call(dev, EVENT_DCHU_COMMAND_GET, empty_input, 0, &acpi_output);
+    if(ret)
+        goto exit;
+
+    acpi_obj = acpi_output.pointer;
+
+    if(acpi_obj->type != ACPI_TYPE_INTEGER) {
+        XMG_LOG_ERR_RL(dev, "got invalid ACPI object type (%d, expected: %d)",
+            acpi_obj->type, ACPI_TYPE_INTEGER);
+        ret = -EFAULT;
+        goto exit;
+    }
+
+    *code = acpi_obj->integer.value;
+
+exit:
+    kfree(acpi_output.pointer);
+    return ret;
+}
+
+// Translate firmware code to event type and fields changed by the firmware
+static int xmg_event_decode(unsigned int code, unsigned int* type, unsigned int* mask) {
+    switch(code) {
+        case KEYBOARD_EVENT_BRIGHTNESS_DOWN:
+            *type = XMG_EVENT_BRIGHTNESS_DOWN;
+            *mask = XMG_STATE_BRIGHTNESS;
+            break;
+        case KEYBOARD_EVENT_BRIGHTNESS_UP:
+            *type = XMG_EVENT_BRIGHTNESS_UP;
+            *mask = XMG_STATE_BRIGHTNESS;
+            break;
+        case KEYBOARD_EVENT_CYCLE_COLOR:
+            *type = XMG_EVENT_CYCLE_COLOR;
+            *mask = XMG_STATE_COLOR;
+            break;
+        case KEYBOARD_EVENT_CYCLE_BRIGHTNESS:
+            *type = XMG_EVENT_CYCLE_BRIGHTNESS;
+            *mask = XMG_STATE_BRIGHTNESS;
+            break;
+        case KEYBOARD_EVENT_TOGGLE:
+            *type = XMG_EVENT_TOGGLE;
+            *mask = XMG_STATE_BRIGHTNESS;
+            break;
+        default:
+            return -EINVAL;
+    }
+    return 0;
+}
+
+static void xmg_event_queue(struct xmg_data* xmg, struct xmg_event* event) {
+    spin_lock(&xmg->event_lock);
+    xmg->events[xmg->event_head % XMG_EVENT_RING_SIZE] = *event;
+    xmg->event_head++;
+    spin_unlock(&xmg->event_lock);
+
+    wake_up_interruptible(&xmg->event_wq);
+}
+
+static bool xmg_event_pending(struct xmg_data* xmg, struct xmg_file* xfile) {
+    bool pending;
+
+    spin_lock(&xmg->event_lock);
+    pending = xfile->event_cursor != xmg->event_head;
+    spin_unlock(&xmg->event_lock);
+    return pending;
+}
+
+// Take next event for given reader - returns false if there is none
+static bool xmg_event_pop(struct xmg_data* xmg, struct xmg_file* xfile, struct xmg_event* event) {
+    bool lost = false;
+
+    spin_lock(&xmg->event_lock);
+    if(xfile->event_cursor == xmg->event_head) {
+        spin_unlock(&xmg->event_lock);
+        return false;
+    }
+
+    // Skip events which were already overwritten
+    if(xmg->event_head - xfile->event_cursor > XMG_EVENT_RING_SIZE) {
+        xfile->event_cursor = xmg->event_head - XMG_EVENT_RING_SIZE;
+        lost = true;
+    }
+
+    *event = xmg->events[xfile->event_cursor % XMG_EVENT_RING_SIZE];
+    xfile->event_cursor++;
+    spin_unlock(&xmg->event_lock);
+
+    if(lost)
+        event->flags |= XMG_EVENT_LOST;
+    return true;
+}
+
+static void xmg_acpi_notify(acpi_handle handle, u32 value, void* data) {
+    struct xmg_data* xmg = data;
+    struct device* dev = &xmg->pdev->dev;
+    struct xmg_event event = {0};
+    unsigned int mask;
+
+    if(xmg_event_fetch(dev, &event.code))
+        return;
+
+    // Device is notified also about hotkeys unrelated to the keyboard
+    if(xmg_event_decode(event.code, &event.type, &mask))
+        return;
+
+    event.timestamp_ns = ktime_get_ns();
+    event.generation = xmg_driver_forget_state(xmg, mask);
+    xmg_event_queue(xmg, &event);
+}
+
+static int xmg_events_init(struct xmg_data* xmg) {
+    acpi_status status;
+
+    spin_lock_init(&xmg->event_lock);
+    init_waitqueue_head(&xmg->event_wq);
+    xmg->event_head = 0;
+
+    status = acpi_install_notify_handler(ACPI_HANDLE(&xmg->pdev->dev), ACPI_DEVICE_NOTIFY,
+                                         xmg_acpi_notify, xmg);
+    if(ACPI_FAILURE(status)) {
+        XMG_LOG_ERR(&xmg->pdev->dev, "failed to install notify handler - ACPI Error: %s",
+            acpi_format_exception(status));
+        return -ENODEV;
+    }
+    return 0;
+}
+
+// Waits for notify handler which is already running
+static void xmg_events_remove(struct xmg_data* xmg) {
+    acpi_remove_notify_handler(ACPI_HANDLE(&xmg->pdev->dev), ACPI_DEVICE_NOTIFY, xmg_acpi_notify);
+}
+
+/*
+ * HWMON SUPPORT
+ */
+/*
+* Convert value returned by ACPI call to rotations per minute (RPM)
+*  - this formula is equivalent to `2 * 60 / (128 / 23 * acpi_value)`
+*/
+#define XMG_ACPI_RPM_TO_REAL(X) (2156250ull / (unsigned long long) X)
+
+// Raw value of 0 means that no pulses were counted - fan doesn't spin
+static u32 xmg_fan_rpm(u16 acpi_value) {
+    return acpi_value ? XMG_ACPI_RPM_TO_REAL(acpi_value) : 0;
+}
+
+static int xmg_fan_fetch_data(struct device* dev, struct xmg_fan_acpi_response* fan_data) {
+    int ret = 0;
+    char empty_input[0x10] = {0};
+    union acpi_object* acpi_obj;
+    struct acpi_buffer acpi_output = {0};
+
+    ret = xmg_acpi_call(dev, FAN_DCHU_COMMAND_GET, empty_input, 0, &acpi_output);
+    if(ret)
+        goto exit;
+    
+    /*
+     * acpi_output contains pointer to acpi_object
+     */
+    acpi_obj = acpi_output.pointer;
+
+    if(acpi_obj->type != ACPI_TYPE_BUFFER) {
+        XMG_LOG_ERR_RL(dev, "got invalid ACPI buffer type (%d, expected: %d)",
+            acpi_obj->type, ACPI_TYPE_BUFFER);
+        ret = -EFAULT;
+        goto exit;
+    }
+
+    if(acpi_obj->buffer.length < sizeof(struct xmg_fan_acpi_response)) {
+        XMG_LOG_ERR_RL(dev, "got invalid ACPI buffer size (%d, expected min.: %lu)",
+            acpi_obj->buffer.length, sizeof(struct xmg_fan_acpi_response));
+        ret = -EFAULT;
+        goto exit;
+    }
+
+    memcpy(fan_data, acpi_obj->buffer.pointer, sizeof(*fan_data));
+
+    // Fix endianess
+    fan_data->cpu_rpm = be16_to_cpu(fan_data->cpu_rpm);
+    fan_data->gpu_rpm = be16_to_cpu(fan_data->gpu_rpm);
+    fan_data->gpu2_rpm = be16_to_cpu(fan_data->gpu2_rpm);
+
+exit:
+    kfree(acpi_output.pointer);
+    return ret;
+}
+
+/*
+ * Read fan data with single-flight semantics - if the same read is already
+ *  in progress, wait for it and share its result instead of issuing
+ *  another _DSM call
+ */
+static int xmg_fan_get_data(struct device* dev, struct xmg_fan_acpi_response* fan_data) {
+    struct xmg_data* xmg = dev_get_drvdata(dev);
+    unsigned int gen;
+    int ret;
+
+    spin_lock(&xmg->fan_flight_lock);
+    if(xmg->fan_inflight) {
+        gen = xmg->fan_flight_gen;
+        spin_unlock(&xmg->fan_flight_lock);
+
+        wait_event(xmg->fan_flight_wq, READ_ONCE(xmg->fan_flight_gen) != gen);
+        atomic_inc(&xmg->fan_shared);
+
+        // Result of a later call may be copied, which is just as fresh
+        spin_lock(&xmg->fan_flight_lock);
+        ret = xmg->fan_flight_ret;
+        *fan_data = xmg->fan_flight_data;
+        spin_unlock(&xmg->fan_flight_lock);
+        return ret;
+    }
+    xmg->fan_inflight = true;
+    spin_unlock(&xmg->fan_flight_lock);
+
+    ret = xmg_fan_fetch_data(dev, fan_data);
+
+    spin_lock(&xmg->fan_flight_lock);
+    xmg->fan_flight_ret = ret;
+    xmg->fan_flight_data = *fan_data;
+    WRITE_ONCE(xmg->fan_flight_gen, xmg->fan_flight_gen + 1);
+    xmg->fan_inflight = false;
+    spin_unlock(&xmg->fan_flight_lock);
+
+    wake_up_all(&xmg->fan_flight_wq);
+    return ret;
+}
+
+/*
+ * Serve fan data from the per-device snapshot, refreshing it at most
+ *  once per update_interval. Refresh is done without fan_lock held, so
+ *  concurrent hwmon, thermal and IIO readers join the call in flight
+ */
+static int xmg_fan_get_cached(struct xmg_data* xmg, struct xmg_fan_acpi_response* fan_data) {
+    int ret = 0;
+    struct xmg_fan_acpi_response fresh_data;
+
+    mutex_lock(&xmg->fan_lock);
+
+    // Don't make pending keyboard writes wait behind sensor refresh - serve
+    //  stale data instead, but never older than one extra update_interval,
+    //  as thermal zones read it too
+    if(xmg->fan_data_valid && xmg_keyboard_busy(xmg) &&
+       time_before(jiffies, xmg->fan_data_expires + msecs_to_jiffies(xmg->update_interval)))
+        goto copy;
+
+    if(xmg->fan_data_valid && time_before(jiffies, xmg->fan_data_expires))
+        goto copy;
+    mutex_unlock(&xmg->fan_lock);
+
+    ret = xmg_fan_get_data(&xmg->pdev->dev, &fresh_data);
+
+    // Every reader which took part in the call publishes the same result
+    mutex_lock(&xmg->fan_lock);
+    if(ret) {
+        xmg->fan_data_valid = false;
+        goto exit;
+    }
+
+    xmg->fan_data = fresh_data;
+    xmg->fan_data_valid = true;
+    xmg->fan_data_expires = jiffies + msecs_to_jiffies(xmg->update_interval);
+
+copy:
+    *fan_data = xmg->fan_data;
+exit:
+    mutex_unlock(&xmg->fan_lock);
+    return ret;
+}
+
+// Values of a single hwmon channel (0 - CPU, 1 - GPU, 2 - GPU2)
+struct xmg_fan_channel {
+    u16 rpm;                            // raw ACPI value
+    u8 duty;
+    u8 temp;
+};
+
+static void xmg_fan_channel(struct xmg_fan_acpi_response* fan_data, int channel,
+                    struct xmg_fan_channel* out) {
+    switch(channel) {
+        case 0:
+            out->rpm = fan_data->cpu_rpm;
+            out->duty = fan_data->cpu_duty;
+            out->temp = fan_data->cpu_temp;
+            break;
+        case 1:
+            out->rpm = fan_data->gpu_rpm;
+            out->duty = fan_data->gpu_duty;
+            out->temp = fan_data->gpu_temp;
+            break;
+        default:
+            out->rpm = fan_data->gpu2_rpm;
+            out->duty = fan_data->gpu2_duty;
+            out->temp = fan_data->gpu2_temp;
+            break;
+    }
+}
+
+// Embedded controller reports only zeros for channels which are not wired
+//  on this model or whose GPU is runtime-suspended
+static bool xmg_fan_channel_has_data(const struct xmg_fan_channel* values) {
+    return values->rpm || values->duty || values->temp;
+}
+
+/*
+ * Background sampler - evaluates alarms and notifies pollers about their
+ *  changes. Runs only while some limit is set and reads the same cached
+ *  snapshot as hwmon, so it never refreshes faster than update_interval
+ */
+static bool xmg_sampler_limits_set(struct xmg_data* xmg) {
+    int i;
+
+    for(i = 0; i < XMG_HWMON_CHANNELS; i++)
+        if(xmg->temp_max[i] || xmg->temp_crit[i] || xmg->fan_min[i])
+            return true;
+    return false;
+}
+
+// Called with fan_lock held
+static unsigned long xmg_sampler_check_alarms(struct xmg_data* xmg, struct xmg_fan_acpi_response* fan_data) {
+    struct xmg_fan_channel values;
+    unsigned long alarms = 0;
+    int i, temp, rpm;
+
+    for(i = 0; i < XMG_HWMON_CHANNELS; i++) {
+        xmg_fan_channel(fan_data, i, &values);
+        if(!xmg_fan_channel_has_data(&values))
+            continue;
+
+        temp = values.temp * 1000;
+        rpm = xmg_fan_rpm(values.rpm);
+
+        if(xmg->temp_max[i] && temp >= xmg->temp_max[i])
+            __set_bit(XMG_ALARM_BIT(i, XMG_ALARM_TEMP_MAX), &alarms);
+        if(xmg->temp_crit[i] && temp >= xmg->temp_crit[i])
+            __set_bit(XMG_ALARM_BIT(i, XMG_ALARM_TEMP_CRIT), &alarms);
+        if(xmg->fan_min[i] && rpm < xmg->fan_min[i])
+            __set_bit(XMG_ALARM_BIT(i, XMG_ALARM_FAN_MIN), &alarms);
+    }
+    return alarms;
+}
+
+static void xmg_sampler_notify(struct xmg_data* xmg, int bit) {
+    int channel = bit / XMG_ALARMS_PER_CHANNEL;
+
+    switch(bit % XMG_ALARMS_PER_CHANNEL) {
+        case XMG_ALARM_TEMP_MAX:
+            hwmon_notify_event(xmg->hdev, hwmon_temp, hwmon_temp_max_alarm, channel);
+            break;
+        case XMG_ALARM_TEMP_CRIT:
+            hwmon_notify_event(xmg->hdev, hwmon_temp, hwmon_temp_crit_alarm, channel);
+            break;
+        case XMG_ALARM_FAN_MIN:
+            hwmon_notify_event(xmg->hdev, hwmon_fan, hwmon_fan_min_alarm, channel);
+            break;
+    }
+}
+
+// Called after limit change
+static void xmg_sampler_kick(struct xmg_data* xmg) {
+    if(!READ_ONCE(xmg->sampler_stopped))
+        mod_delayed_work(system_wq, &xmg->sampler_work, 0);
+}
+
+static void xmg_sampler_work(struct work_struct* work) {
+    struct xmg_data* xmg = container_of(to_delayed_work(work), struct xmg_data, sampler_work);
+    struct xmg_fan_acpi_response fan_data;
+    struct xmg_fan_channel values;
+    unsigned long alarms, changed = 0;
+    int i, delta = 0, ret;
+    bool active;
+
+    ret = xmg_fan_get_cached(xmg, &fan_data);
+
+    mutex_lock(&xmg->fan_lock);
+    if(!ret) {
+        // Adapt sampling rate to the speed of temperature changes
+        for(i = 0; i < XMG_HWMON_CHANNELS; i++) {
+            xmg_fan_channel(&fan_data, i, &values);
+            delta = max(delta, abs(values.temp - xmg->last_temp[i]));
+            xmg->last_temp[i] = values.temp;
+        }
+        if(delta >= SAMPLER_TEMP_DELTA)
+            xmg->sampler_interval = clamp_t(unsigned int, xmg->update_interval,
+                                            SAMPLER_MIN_INTERVAL, SAMPLER_MAX_INTERVAL);
+        else if(delta == 0)
+            xmg->sampler_interval = min_t(unsigned int, xmg->sampler_interval * 2, SAMPLER_MAX_INTERVAL);
+
+        alarms = xmg_sampler_check_alarms(xmg, &fan_data);
+        changed = alarms ^ xmg->alarms;
+        xmg->alarms = alarms;
+    }
+
+    active = xmg_sampler_limits_set(xmg);
+    mutex_unlock(&xmg->fan_lock);
+
+    for_each_set_bit(i, &changed, XMG_ALARMS_COUNT)
+        xmg_sampler_notify(xmg, i);
+
+    // Pause when no limit is set - setting one restarts it
+    if(active && !READ_ONCE(xmg->sampler_stopped))
+        queue_delayed_work(system_wq, &xmg->sampler_work, msecs_to_jiffies(xmg->sampler_interval));
+}
+
+static void xmg_sampler_init(struct xmg_data* xmg) {
+    INIT_DELAYED_WORK(&xmg->sampler_work, xmg_sampler_work);
+    xmg->sampler_stopped = false;
+    xmg->sampler_interval = SAMPLER_MIN_INTERVAL;
+    xmg->alarms = 0;
+}
+
+static void xmg_sampler_stop(struct xmg_data* xmg) {
+    WRITE_ONCE(xmg->sampler_stopped, true);
+    cancel_delayed_work_sync(&xmg->sampler_work);
+}
+
+static void xmg_sampler_start(struct xmg_data* xmg) {
+    WRITE_ONCE(xmg->sampler_stopped, false);
+    if(xmg_sampler_limits_set(xmg))
+        queue_delayed_work(system_wq, &xmg->sampler_work, 0);
+}
+
+/*
+ * hwmon channels - every input of a single read is served from the same
+ *  cached response, so reading all sensors costs one _DSM call
+ */
+static const char* XMG_TEMP_LABELS[XMG_HWMON_CHANNELS] = {
+    "CPU Temp",
+    "GPU Temp",
+    "GPU2 Temp",
+};
+
+static const char* XMG_FAN_LABELS[XMG_HWMON_CHANNELS] = {
+    "CPU Fan",
+    "GPU Fan",
+    "GPU2 Fan",
+};
+
+static int xmg_hwmon_read_input(struct xmg_data* xmg, enum hwmon_sensor_types type,
+                    int channel, long* val) {
+    struct device* dev = &xmg->pdev->dev;
+    struct xmg_fan_acpi_response fan_data;
+    struct xmg_fan_channel values;
+    int ret;
+
+    ret = xmg_fan_get_cached(xmg, &fan_data);
+    if(ret != 0) {
+        atomic_inc(&xmg->hwmon_errors);
+        XMG_LOG_ERR_RL(dev, "failed to get fan_data (ret=%d)", ret);
+        return ret;
+    }
+
+    xmg_fan_channel(&fan_data, channel, &values);
+    if(!xmg_fan_channel_has_data(&values))
+        return -ENODATA;
+
+    switch(type) {
+        case hwmon_temp:
+            *val = values.temp * 1000;
+            return 0;
+
+        case hwmon_pwm:
+            *val = values.duty;
+            return 0;
+
+        case hwmon_fan:
+            // Stopped fan is reported as 0 RPM, same as fan_min alarm sees it
+            if(values.rpm == 0)
+                atomic_inc(&xmg->fan_stalled);
+            *val = xmg_fan_rpm(values.rpm);
+            return 0;
+
+        default:
+            return -EOPNOTSUPP;
+    }
+}
+
+static int* xmg_hwmon_limit(struct xmg_data* xmg, enum hwmon_sensor_types type, u32 attr, int channel) {
+    if(type == hwmon_temp && attr == hwmon_temp_max)
+        return &xmg->temp_max[channel];
+    if(type == hwmon_temp && attr == hwmon_temp_crit)
+        return &xmg->temp_crit[channel];
+    if(type == hwmon_fan && attr == hwmon_fan_min)
+        return &xmg->fan_min[channel];
+    return NULL;
+}
+
+static int xmg_hwmon_alarm_bit(enum hwmon_sensor_types type, u32 attr, int channel) {
+    if(type == hwmon_temp && attr == hwmon_temp_max_alarm)
+        return XMG_ALARM_BIT(channel, XMG_ALARM_TEMP_MAX);
+    if(type == hwmon_temp && attr == hwmon_temp_crit_alarm)
+        return XMG_ALARM_BIT(channel, XMG_ALARM_TEMP_CRIT);
+    if(type == hwmon_fan && attr == hwmon_fan_min_alarm)
+        return XMG_ALARM_BIT(channel, XMG_ALARM_FAN_MIN);
+    return -1;
+}
+
+static int xmg_hwmon_read(struct device* hwdev, enum hwmon_sensor_types type,
+                    u32 attr, int channel, long* val) {
+    struct xmg_data* xmg = dev_get_drvdata(hwdev);
+    int* limit;
+    int bit;
+
+    if(type == hwmon_chip && attr == hwmon_chip_update_interval) {
+        *val = READ_ONCE(xmg->update_interval);
+        return 0;
+    }
+
+    if((type == hwmon_temp && attr == hwmon_temp_input) ||
+       (type == hwmon_fan && attr == hwmon_fan_input) ||
+       (type == hwmon_pwm && attr == hwmon_pwm_input))
+        return xmg_hwmon_read_input(xmg, type, channel, val);
+
+    limit = xmg_hwmon_limit(xmg, type, attr, channel);
+    if(limit) {
+        mutex_lock(&xmg->fan_lock);
+        *val = *limit;
+        mutex_unlock(&xmg->fan_lock);
+        return 0;
+    }
+
+    bit = xmg_hwmon_alarm_bit(type, attr, channel);
+    if(bit >= 0) {
+        *val = test_bit(bit, &xmg->alarms);
+        return 0;
+    }
+    return -EOPNOTSUPP;
+}
+
+static int xmg_hwmon_read_string(struct device* hwdev, enum hwmon_sensor_types type,
+                    u32 attr, int channel, const char** str) {
+    if(type == hwmon_temp)
+        *str = XMG_TEMP_LABELS[channel];
+    else if(type == hwmon_fan)
+        *str = XMG_FAN_LABELS[channel];
+    else
+        return -EOPNOTSUPP;
+    return 0;
+}
+
+static int xmg_hwmon_write(struct device* hwdev, enum hwmon_sensor_types type,
+                    u32 attr, int channel, long val) {
+    struct xmg_data* xmg = dev_get_drvdata(hwdev);
+    int* limit;
+
+    if(type == hwmon_chip && attr == hwmon_chip_update_interval) {
+        if(val < 0 || val > FAN_MAX_UPDATE_INTERVAL)
+            return -EINVAL;
+
+        // Force refresh on the next read, so new interval takes effect immediately
+        mutex_lock(&xmg->fan_lock);
+        xmg->update_interval = val;
+        xmg->fan_data_valid = false;
+        mutex_unlock(&xmg->fan_lock);
+        return 0;
+    }
+
+    limit = xmg_hwmon_limit(xmg, type, attr, channel);
+    if(!limit)
+        return -EOPNOTSUPP;
+    if(val < 0 || val > INT_MAX)
+        return -EINVAL;
+
+    mutex_lock(&xmg->fan_lock);
+    *limit = val;
+    mutex_unlock(&xmg->fan_lock);
+
+    // Re-evaluate alarms with the new limit
+    xmg_sampler_kick(xmg);
+    return 0;
+}
+
+// All channels are always exposed - GPU ones read as -ENODATA while powered down
+static umode_t xmg_hwmon_is_visible(const void* drvdata, enum hwmon_sensor_types type,
+                    u32 attr, int channel) {
+    if(type == hwmon_chip)
+        return 0644;
+
+    if(xmg_hwmon_alarm_bit(type, attr, channel) >= 0)
+        return 0444;
+    if(type == hwmon_temp && (attr == hwmon_temp_max || attr == hwmon_temp_crit))
+        return 0644;
+    if(type == hwmon_fan && attr == hwmon_fan_min)
+        return 0644;
+    return 0444;
+}
+
+#define XMG_HWMON_TEMP_CONFIG   (HWMON_T_INPUT | HWMON_T_LABEL | HWMON_T_MAX | HWMON_T_CRIT | \
+                                 HWMON_T_MAX_ALARM | HWMON_T_CRIT_ALARM)
+#define XMG_HWMON_FAN_CONFIG    (HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_MIN | HWMON_F_MIN_ALARM)
+
+static const struct hwmon_channel_info* const xmg_hwmon_info[] = {
+    HWMON_CHANNEL_INFO(chip, HWMON_C_UPDATE_INTERVAL),
+    HWMON_CHANNEL_INFO(temp, XMG_HWMON_TEMP_CONFIG, XMG_HWMON_TEMP_CONFIG, XMG_HWMON_TEMP_CONFIG),
+    HWMON_CHANNEL_INFO(fan, XMG_HWMON_FAN_CONFIG, XMG_HWMON_FAN_CONFIG, XMG_HWMON_FAN_CONFIG),
+    HWMON_CHANNEL_INFO(pwm, HWMON_PWM_INPUT, HWMON_PWM_INPUT, HWMON_PWM_INPUT),
+    NULL
+};
+
+static const struct hwmon_ops xmg_hwmon_ops = {
+    .is_visible = xmg_hwmon_is_visible,
+    .read = xmg_hwmon_read,
+    .read_string = xmg_hwmon_read_string,
+    .write = xmg_hwmon_write,
+};
+
+static const struct hwmon_chip_info xmg_hwmon_chip_info = {
+    .ops = &xmg_hwmon_ops,
+    .info = xmg_hwmon_info,
+};
+
+static int xmg_hwmon_init(struct xmg_data* xmg) {
+    int ret = 0;
+
+    xmg_sampler_init(xmg);
+
+    xmg->hdev = hwmon_device_register_with_info(&xmg->pdev->dev, "xmg_acpi", xmg,
+                                                &xmg_hwmon_chip_info, NULL);
+    if(IS_ERR(xmg->hdev))
+        ret = PTR_ERR(xmg->hdev);
+    return ret;
+}
+
+static void xmg_hwmon_remove(struct xmg_data* xmg) {
+    xmg_sampler_stop(xmg);
+    hwmon_device_unregister(xmg->hdev);
+    // Reads which were in progress during unregistration could have restarted it
+    cancel_delayed_work_sync(&xmg->sampler_work);
+}
+
+
+/*
+ * THERMAL ZONES
+ *  - CPU and GPU temperatures for in-kernel thermal governors, served from
+ *    the same cached response as hwmon
+ */
+#if IS_REACHABLE(CONFIG_THERMAL)
+static const char* XMG_THERMAL_TYPES[XMG_THERMAL_ZONES] = {
+    "xmg_cpu",
+    "xmg_gpu",
+};
+
+// 85 - 95°C is normal under load on these machines - firmware manages fans
+//  on its own, so don't add a throttling policy unless asked to
+static bool thermal_throttle;
+module_param(thermal_throttle, bool, 0444);
+MODULE_PARM_DESC(thermal_throttle, "Bind passive trip of CPU thermal zone to processor cooling devices");
+
+static int xmg_thermal_get_temp(struct thermal_zone_device* tz, int* temp) {
+    struct xmg_thermal_priv* priv = thermal_zone_device_priv(tz);
+    struct xmg_data* xmg = priv->xmg;
+    struct xmg_fan_acpi_response fan_data;
+    struct xmg_fan_channel values;
+    int ret;
+
+    ret = xmg_fan_get_cached(xmg, &fan_data);
+    if(ret) {
+        atomic_inc(&xmg->hwmon_errors);
+        return ret;
+    }
+
+    xmg_fan_channel(&fan_data, priv->channel, &values);
+    *temp = values.temp * 1000;
+    return 0;
+}
+
+// Let CPU zone throttle processors on passive trip, if enabled
+static bool xmg_thermal_cpu_cdev(struct thermal_zone_device* tz, struct thermal_cooling_device* cdev) {
+    struct xmg_thermal_priv* priv = thermal_zone_device_priv(tz);
+
+    return thermal_throttle && priv->channel == XMG_THERMAL_CPU && !strcmp(cdev->type, "Processor");
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+static bool xmg_thermal_should_bind(struct thermal_zone_device* tz, const struct thermal_trip* trip,
+            struct thermal_cooling_device* cdev, struct cooling_spec* spec) {
+    // Default cooling_spec - no limits and default weight
+    return trip->type == THERMAL_TRIP_PASSIVE && xmg_thermal_cpu_cdev(tz, cdev);
+}
+
+static struct thermal_zone_device_ops xmg_thermal_ops = {
+    .get_temp = xmg_thermal_get_temp,
+    .should_bind = xmg_thermal_should_bind,
+};
+#else
+static int xmg_thermal_bind(struct thermal_zone_device* tz, struct thermal_cooling_device* cdev) {
+    if(!xmg_thermal_cpu_cdev(tz, cdev))
+        return 0;
+
+    return thermal_zone_bind_cooling_device(tz, 0, cdev, THERMAL_NO_LIMIT,
+                                            THERMAL_NO_LIMIT, THERMAL_WEIGHT_DEFAULT);
+}
+
+static int xmg_thermal_unbind(struct thermal_zone_device* tz, struct thermal_cooling_device* cdev) {
+    if(!xmg_thermal_cpu_cdev(tz, cdev))
+        return 0;
+
+    return thermal_zone_unbind_cooling_device(tz, 0, cdev);
+}
+
+static struct thermal_zone_device_ops xmg_thermal_ops = {
+    .get_temp = xmg_thermal_get_temp,
+    .bind = xmg_thermal_bind,
+    .unbind = xmg_thermal_unbind,
+};
+#endif
+
+static void xmg_thermal_remove(struct xmg_data* xmg) {
+    int i;
+
+    for(i = 0; i < XMG_THERMAL_ZONES; i++) {
+        if(!IS_ERR_OR_NULL(xmg->tzd[i]))
+            thermal_zone_device_unregister(xmg->tzd[i]);
+        xmg->tzd[i] = NULL;
+    }
+}
+
+static int xmg_thermal_init(struct xmg_data* xmg) {
+    struct thermal_trip* trips;
+    int i, ret;
+
+    for(i = 0; i < XMG_THERMAL_ZONES; i++) {
+        // Zone index matches hwmon channel (CPU, GPU)
+        xmg->thermal_priv[i].xmg = xmg;
+        xmg->thermal_priv[i].channel = i;
+
+        trips = xmg->thermal_trips[i];
+        trips[0] = (struct thermal_trip) {
+            .temperature = THERMAL_PASSIVE_TEMP,
+            .hysteresis = THERMAL_HYSTERESIS,
+            .type = THERMAL_TRIP_PASSIVE,
+        };
+
+        // Trip is writable through trip_point_0_temp in sysfs
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+        trips[0].flags = THERMAL_TRIP_FLAG_RW_TEMP;
+        xmg->tzd[i] = thermal_zone_device_register_with_trips(XMG_THERMAL_TYPES[i], trips,
+                            XMG_THERMAL_TRIPS, &xmg->thermal_priv[i], &xmg_thermal_ops, NULL,
+                            THERMAL_PASSIVE_DELAY, THERMAL_POLLING_DELAY);
+#else
+        xmg->tzd[i] = thermal_zone_device_register_with_trips(XMG_THERMAL_TYPES[i], trips,
+                            XMG_THERMAL_TRIPS, GENMASK(XMG_THERMAL_TRIPS - 1, 0), &xmg->thermal_priv[i],
+                            &xmg_thermal_ops, NULL, THERMAL_PASSIVE_DELAY, THERMAL_POLLING_DELAY);
+#endif
+        if(IS_ERR(xmg->tzd[i])) {
+            ret = PTR_ERR(xmg->tzd[i]);
+            goto err;
+        }
+
+        ret = thermal_zone_device_enable(xmg->tzd[i]);
+        if(ret)
+            goto err;
+    }
+    return 0;
+
+err:
+    xmg_thermal_remove(xmg);
+    return ret;
+}
+#else
+static int xmg_thermal_init(struct xmg_data* xmg) {
+    return 0;
+}
+
+static void xmg_thermal_remove(struct xmg_data* xmg) {
+}
+#endif
+
+
+/*
+ * IIO SUPPORT
+ */
+#if IS_REACHABLE(CONFIG_IIO_TRIGGERED_BUFFER)
+#define XMG_IIO_CHANNEL(TYPE, INDEX, ADDR, BITS, INFO) {        \
+    .type = TYPE,                                               \
+    .indexed = 1,                                               \
+    .channel = INDEX,                                           \
+    .address = ADDR,                                            \
+    .scan_index = ADDR,                                         \
+    .info_mask_separate = BIT(IIO_CHAN_INFO_RAW),               \
+    .info_mask_shared_by_type = INFO,                           \
+    .scan_type = {                                              \
+        .sign = 'u',                                            \
+        .realbits = BITS,                                       \
+        .storagebits = BITS,                                    \
+        .endianness = IIO_CPU,                                  \
+    },                                                          \
+}
+
+/*
+ * Fan speed is reported in RPM (scale converts it to rad/s as required by
+ *  IIO ABI) and temperature in degrees Celsius. IIO has no channel type for
+ *  a duty ratio - duty is available only as hwmon pwmN
+ */
+static const struct iio_chan_spec xmg_iio_channels[] = {
+    XMG_IIO_CHANNEL(IIO_ANGL_VEL, 0, XMG_IIO_CPU_RPM, 32, BIT(IIO_CHAN_INFO_SCALE)),
+    XMG_IIO_CHANNEL(IIO_ANGL_VEL, 1, XMG_IIO_GPU_RPM, 32, BIT(IIO_CHAN_INFO_SCALE)),
+    XMG_IIO_CHANNEL(IIO_ANGL_VEL, 2, XMG_IIO_GPU2_RPM, 32, BIT(IIO_CHAN_INFO_SCALE)),
+    XMG_IIO_CHANNEL(IIO_TEMP, 0, XMG_IIO_CPU_TEMP, 8, BIT(IIO_CHAN_INFO_SCALE)),
+    XMG_IIO_CHANNEL(IIO_TEMP, 1, XMG_IIO_GPU_TEMP, 8, BIT(IIO_CHAN_INFO_SCALE)),
+    XMG_IIO_CHANNEL(IIO_TEMP, 2, XMG_IIO_GPU2_TEMP, 8, BIT(IIO_CHAN_INFO_SCALE)),
+    IIO_CHAN_SOFT_TIMESTAMP(XMG_IIO_TIMESTAMP),
+};
+
+// Whole scan is always captured - IIO core extracts channels enabled by user
+static const unsigned long xmg_iio_scan_masks[] = {
+    GENMASK(XMG_IIO_GPU2_TEMP, XMG_IIO_CPU_RPM),
+    0
+};
+
+static void xmg_iio_fill_scan(struct xmg_iio_scan_data* scan, struct xmg_fan_acpi_response* fan_data) {
+    struct xmg_fan_channel values;
+    int i;
+
+    for(i = 0; i < XMG_HWMON_CHANNELS; i++) {
+        xmg_fan_channel(fan_data, i, &values);
+        scan->rpm[i] = xmg_fan_rpm(values.rpm);
+        scan->temp[i] = values.temp;
+    }
+}
+
+static irqreturn_t xmg_iio_trigger_handler(int irq, void* p) {
+    struct iio_poll_func* pf = p;
+    struct iio_dev* indio_dev = pf->indio_dev;
+    struct xmg_data* xmg = iio_device_get_drvdata(indio_dev);
+    struct xmg_fan_acpi_response fan_data;
+    struct xmg_iio_scan_data scan;
+    int ret;
+
+    memset(&scan, 0, sizeof(scan));
+
+    // Let pending keyboard writes go first - fill the scan from the cached
+    //  snapshot instead, so the stream keeps its rate
+    if(xmg_keyboard_busy(xmg)) {
+        atomic_inc(&xmg->iio_cached_scans);
+        ret = xmg_fan_get_cached(xmg, &fan_data);
+    } else {
+        ret = xmg_fan_get_data(&xmg->pdev->dev, &fan_data);
+    }
+    if(ret) {
+        atomic_inc(&xmg->hwmon_errors);
+        goto done;
+    }
+
+    xmg_iio_fill_scan(&scan, &fan_data);
+    iio_push_to_buffers_with_timestamp(indio_dev, &scan, pf->timestamp);
+
+done:
+    iio_trigger_notify_done(indio_dev->trig);
+    return IRQ_HANDLED;
+}
+
+static int xmg_iio_read_raw(struct iio_dev* indio_dev, struct iio_chan_spec const* chan,
+                    int* val, int* val2, long mask) {
+    struct xmg_data* xmg = iio_device_get_drvdata(indio_dev);
+    struct xmg_fan_acpi_response fan_data;
+    struct xmg_iio_scan_data scan;
+    int ret;
+
+    switch(mask) {
+        case IIO_CHAN_INFO_RAW:
+            ret = iio_device_claim_direct_mode(indio_dev);
+            if(ret)
+                return ret;
+            ret = xmg_fan_get_cached(xmg, &fan_data);
+            iio_device_release_direct_mode(indio_dev);
+            if(ret)
+                return ret;
+
+            xmg_iio_fill_scan(&scan, &fan_data);
+            if(chan->address <= XMG_IIO_GPU2_RPM)
+                *val = scan.rpm[chan->address - XMG_IIO_CPU_RPM];
+            else
+                *val = scan.temp[chan->address - XMG_IIO_CPU_TEMP];
+            return IIO_VAL_INT;
+
+        case IIO_CHAN_INFO_SCALE:
+            if(chan->type == IIO_TEMP) {
+                // Degrees Celsius to millidegrees
+                *val = 1000;
+                return IIO_VAL_INT;
+            }
+            // RPM to rad/s (2 * pi / 60)
+            *val = 0;
+            *val2 = 104719755;
+            return IIO_VAL_INT_PLUS_NANO;
+
+        default:
+            return -EINVAL;
+    }
+}
+
+static const struct iio_info xmg_iio_info = {
+    .read_raw = xmg_iio_read_raw,
+};
+
+static int xmg_iio_init(struct xmg_data* xmg) {
+    int ret;
+
+    xmg->iio = iio_device_alloc(&xmg->pdev->dev, 0);
+    if(!xmg->iio)
+        return -ENOMEM;
+
+    iio_device_set_drvdata(xmg->iio, xmg);
+    xmg->iio->name = "xmg_acpi";
+    xmg->iio->info = &xmg_iio_info;
+    xmg->iio->modes = INDIO_DIRECT_MODE;
+    xmg->iio->channels = xmg_iio_channels;
+    xmg->iio->num_channels = ARRAY_SIZE(xmg_iio_channels);
+    xmg->iio->available_scan_masks = xmg_iio_scan_masks;
+
+    ret = iio_triggered_buffer_setup(xmg->iio, iio_pollfunc_store_time,
+                                     xmg_iio_trigger_handler, NULL);
+    if(ret)
+        goto iio_free;
+
+    ret = iio_device_register(xmg->iio);
+    if(ret)
+        goto buffer_cleanup;
+    return 0;
+
+buffer_cleanup:
+    iio_triggered_buffer_cleanup(xmg->iio);
+iio_free:
+    iio_device_free(xmg->iio);
+    return ret;
+}
+
+static void xmg_iio_remove(struct xmg_data* xmg) {
+    iio_device_unregister(xmg->iio);
+    iio_triggered_buffer_cleanup(xmg->iio);
+    iio_device_free(xmg->iio);
+}
+#else
+static int xmg_iio_init(struct xmg_data* xmg) {
+    return 0;
+}
+
+static void xmg_iio_remove(struct xmg_data* xmg) {
+}
+#endif
+
+
+/*
+ * MISC
+ */
+/*
+ * Copy buffer returned by _DSM to userspace - on entry length holds the
+ *  capacity of ubuf, on return size of saved output
+ */
+static int xmg_dchu_copy_output(struct device* dev, struct acpi_buffer* acpi_output,
+            char* __user ubuf, unsigned int* length) {
+    int ret = 0;
+    /*
+     * Despite type, acpi_output contains pointer to kernel object acpi_object
+     *   we need to copy only its content to user
+     */
+    union acpi_object* acpi_obj = acpi_output->pointer;
+    size_t acpi_buffer_size;
+
+    if(acpi_obj->type != ACPI_TYPE_BUFFER) {
+        XMG_LOG_ERR_RL(dev, "ACPI output contains unsupported type (%u)", acpi_obj->type);
+        return -ENOTSUPP;
+    }
+
+    acpi_buffer_size = acpi_obj->buffer.length;
+    if(acpi_buffer_size > *length) {
+        XMG_LOG_WARN_RL(dev, "ACPI output (%lu) is larger than provided buffer size (%d) - "
+                "result will be truncated!", acpi_buffer_size, *length);
+        acpi_buffer_size = *length;
+        ret = -E2BIG;
+    }
+
+    if(copy_to_user(ubuf, acpi_obj->buffer.pointer, acpi_buffer_size)) {
+        XMG_LOG_ERR_RL(dev, "copy to user failed");
+        return -EINVAL;
+    }
+
+    // Length now shows the size of saved output
+    *length = acpi_buffer_size;
+    return ret;
+}
+
+static int xmg_driver_call_dchu(struct device* dev, struct xmg_dchu* dchu) {
+    int ret = 0;
+    struct xmg_data* xmg = dev_get_drvdata(dev);
+    char* kernel_buffer = NULL;
+    struct acpi_buffer acpi_output = {0};
+    
+    if(!dchu->length || dchu->length > XMG_MAX_DCHU_LENGTH)
+        return -EINVAL;
+
+    kernel_buffer = kmalloc(dchu->length, GFP_KERNEL);
+    if(!kernel_buffer)
+        return -ENOMEM;
+
+    if(copy_from_user(kernel_buffer, dchu->ubuf, dchu->length)) {
+        XMG_LOG_ERR_RL(dev, "copy from user failed");
+        ret = -EINVAL;
+        goto exit;
+    }
+
+    ret = xmg_acpi_call(dev, dchu->cmd, kernel_buffer, dchu->length, &acpi_output);
+    if(ret)
+        goto exit;
+
+    ret = xmg_dchu_copy_output(dev, &acpi_output, dchu->ubuf, &dchu->length);
+exit:
+    if(ret)
+        atomic_inc(&xmg->dchu_errors);
+
+    kfree(acpi_output.pointer);
+    kfree(kernel_buffer);
+    return ret;
+}
+
+/*
+ * Copy inputs of all batch entries into a single kernel buffer before
+ *  acpi_lock is taken, so that faulting user pages can't stall other
+ *  _DSM users. Entries which can't be executed get their status here.
+ */
+static char* xmg_dchu_batch_copy_inputs(struct device* dev, struct xmg_dchu_entry* entries,
+            unsigned int count, char** inputs) {
+    size_t total = 0, offset = 0;
+    char* buffer;
+    unsigned int i;
+
+    for(i = 0; i < count; i++) {
+        entries[i].status = 0;
+        entries[i].out_length = 0;
+        if(entries[i].in_length > XMG_MAX_DCHU_LENGTH || entries[i].out_capacity > XMG_MAX_DCHU_LENGTH)
+            entries[i].status = -EINVAL;
+        else
+            total += entries[i].in_length;
+    }
+
+    // Up to XMG_MAX_DCHU_BATCH * XMG_MAX_DCHU_LENGTH bytes
+    buffer = kvmalloc(max_t(size_t, total, 1), GFP_KERNEL);
+    if(!buffer)
+        return NULL;
+
+    for(i = 0; i < count; i++) {
+        if(entries[i].status)
+            continue;
+
+        inputs[i] = buffer + offset;
+        offset += entries[i].in_length;
+        if(copy_from_user(inputs[i], entries[i].in_buf, entries[i].in_length)) {
+            XMG_LOG_ERR_RL(dev, "copy from user failed");
+            entries[i].status = -EINVAL;
+        }
+    }
+    return buffer;
+}
+
+/*
+ * Execute sequence of raw commands - whole batch runs under acpi_lock, so
+ *  no other _DSM call (keyboard or sensors) is interleaved with it. No user
+ *  memory is accessed with the lock held - outputs are kept and copied
+ *  after it is released
+ */
+static int xmg_driver_call_dchu_batch(struct device* dev, struct xmg_dchu_batch* batch) {
+    int ret = 0;
+    struct xmg_data* xmg = dev_get_drvdata(dev);
+    struct xmg_dchu_entry* entries;
+    struct acpi_buffer* outputs;
+    char** inputs;
+    char* input_buffer;
+    unsigned int i;
+
+    batch->completed = 0;
+    if(!batch->count || batch->count > XMG_MAX_DCHU_BATCH ||
+            batch->flags & ~XMG_DCHU_BATCH_STOP_ON_ERROR)
+        return -EINVAL;
+
+    entries = memdup_user(batch->entries, batch->count * sizeof(*entries));
+    if(IS_ERR(entries))
+        return PTR_ERR(entries);
+
+    inputs = kcalloc(batch->count, sizeof(*inputs), GFP_KERNEL);
+    outputs = kcalloc(batch->count, sizeof(*outputs), GFP_KERNEL);
+    if(!inputs || !outputs) {
+        ret = -ENOMEM;
+        goto entries_free;
+    }
+
+    input_buffer = xmg_dchu_batch_copy_inputs(dev, entries, batch->count, inputs);
+    if(!input_buffer) {
+        ret = -ENOMEM;
+        goto entries_free;
+    }
+
+    if(!mutex_trylock(&xmg->acpi_lock)) {
+        atomic_inc(&xmg->acpi_contended);
+        mutex_lock(&xmg->acpi_lock);
+    }
+    for(i = 0; i < batch->count; i++) {
+        if(!entries[i].status)
+            entries[i].status = xmg_acpi_call_locked(dev, entries[i].cmd, inputs[i],
+                                                     entries[i].in_length, &outputs[i]);
+        batch->completed++;
+        if(!entries[i].status)
+            continue;
+
+        atomic_inc(&xmg->dchu_errors);
+        if(batch->flags & XMG_DCHU_BATCH_STOP_ON_ERROR) {
+            ret = entries[i].status;
+            break;
+        }
+    }
+    mutex_unlock(&xmg->acpi_lock);
+
+    // Entries after the first failure with STOP_ON_ERROR were not executed
+    for(i = 0; i < batch->completed; i++) {
+        if(entries[i].status)
+            continue;
+
+        entries[i].out_length = entries[i].out_capacity;
+        entries[i].status = xmg_dchu_copy_output(dev, &outputs[i], entries[i].out_buf,
+                                                 &entries[i].out_length);
+        if(entries[i].status) {
+            atomic_inc(&xmg->dchu_errors);
+            if(batch->flags & XMG_DCHU_BATCH_STOP_ON_ERROR)
+                ret = ret ? : entries[i].status;
+        }
+    }
+
+    if(copy_to_user(batch->entries, entries, batch->count * sizeof(*entries))) {
+        XMG_LOG_ERR_RL(dev, "copy to user failed");
+        ret = -EINVAL;
+    }
+
+    kvfree(input_buffer);
+entries_free:
+    if(outputs) {
+        for(i = 0; i < batch->count; i++)
+            kfree(outputs[i].pointer);
+    }
+    kfree(outputs);
+    kfree(inputs);
+    kfree(entries);
+    return ret;
+}
+
+/*
+ *	FILE OPERATIONS IMPLEMENTATION
+ */
+static inline struct xmg_data* xmg_file_data(struct file* file) {
+    struct xmg_file* xfile = file->private_data;
+
+    return xfile->xmg;
+}
+
+/*
+ * Files may outlive the device - every operation touching the hardware or
+ *  workqueues runs between xmg_file_enter() and xmg_file_leave(), so remove
+ *  waits for operations in progress and later ones fail with ENODEV
+ */
+static int xmg_file_enter(struct xmg_data* xmg) {
+    down_read(&xmg->remove_lock);
+    if(xmg->dead) {
+        up_read(&xmg->remove_lock);
+        return -ENODEV;
+    }
+    return 0;
+}
+
+static void xmg_file_leave(struct xmg_data* xmg) {
+    up_read(&xmg->remove_lock);
+}
+
+// Set requests are queued only after opt-in with XMG_SET_ASYNC
+static inline bool xmg_file_async(struct file* file) {
+    struct xmg_file* xfile = file->private_data;
+
+    return READ_ONCE(xfile->async);
+}
+
+static int xmg_driver_set_field(struct xmg_data* xmg, struct file* file,
+            enum xmg_state_field field, int value) {
+    struct xmg_state state = { .mask = BIT(field) };
+
+    if(xmg_file_async(file))
+        return xmg_async_queue_field(xmg, field, value);
+
+    *xmg_state_field(&state, field) = value;
+    return xmg_driver_apply_state(xmg, &state);
+}
+
+// Every opener reads hotkey events with its own cursor, starting from now
+static int xmg_driver_open(struct inode* inode, struct file* file) {
+    // misc_open() points private_data to our miscdevice
+    struct xmg_data* xmg = container_of(file->private_data, struct xmg_data, mdev);
+    struct xmg_file* xfile;
+
+    if(READ_ONCE(xmg->dead))
+        return -ENODEV;
+
+    xfile = kzalloc(sizeof(*xfile), GFP_KERNEL);
+    if(!xfile)
+        return -ENOMEM;
+
+    // Keep xmg_data alive until the file is released, even after remove
+    kref_get(&xmg->ref);
+    xfile->xmg = xmg;
+    spin_lock(&xmg->event_lock);
+    xfile->event_cursor = xmg->event_head;
+    spin_unlock(&xmg->event_lock);
+
+    file->private_data = xfile;
+    return nonseekable_open(inode, file);
+}
+
+static int xmg_driver_release(struct inode* inode, struct file* file) {
+    struct xmg_file* xfile = file->private_data;
+
+    xmg_data_put(xfile->xmg);
+    kfree(xfile);
+    return 0;
+}
+
+/*
+ * Read as many whole struct xmg_event records as fit in the buffer
+ *  - blocks until at least one event is available, unless O_NONBLOCK is set
+ */
+static ssize_t xmg_driver_read(struct file* file, char __user* buf, size_t count, loff_t* ppos) {
+    struct xmg_file* xfile = file->private_data;
+    struct xmg_data* xmg = xfile->xmg;
+    struct xmg_event event;
+    ssize_t copied = 0;
+    int ret;
+
+    if(count < sizeof(event))
+        return -EINVAL;
+
+    if(!(file->f_flags & O_NONBLOCK)) {
+        // Remove wakes up all readers after marking the device dead
+        ret = wait_event_interruptible(xmg->event_wq,
+                    xmg_event_pending(xmg, xfile) || READ_ONCE(xmg->dead));
+        if(ret)
+            return ret;
+    }
+
+    if(READ_ONCE(xmg->dead))
+        return -ENODEV;
+
+    while(copied + sizeof(event) <= count && xmg_event_pop(xmg, xfile, &event)) {
+        if(copy_to_user(buf + copied, &event, sizeof(event)))
+            return copied ? copied : -EFAULT;
+        copied += sizeof(event);
+    }
+
+    return copied ? copied : -EAGAIN;
+}
+
+static __poll_t xmg_driver_poll(struct file* file, poll_table* wait) {
+    struct xmg_file* xfile = file->private_data;
+    struct xmg_data* xmg = xfile->xmg;
+
+    poll_wait(file, &xmg->event_wq, wait);
+    if(READ_ONCE(xmg->dead))
+        return EPOLLERR | EPOLLHUP;
+    return xmg_event_pending(xmg, xfile) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+static long xmg_driver_ioctl(struct file* file, unsigned int cmd, unsigned long __user arg) {
+    int ret = 0;
+    struct xmg_data* xmg_data = xmg_file_data(file);
+    struct device* dev = &xmg_data->pdev->dev;
+    union {
+        struct xmg_dchu dchu;
+        struct xmg_dchu_batch batch;
+        struct xmg_state state;
+        struct xmg_state_info info;
+        struct xmg_effect effect;
+    } params;
+
+    ret = xmg_file_enter(xmg_data);
+    if(ret)
+        return ret;
+
+    // Don't race with state restore queued after resume
+    xmg_driver_flush_pending(xmg_data);
+
+    switch(cmd) {
+        case XMG_SET_BRIGHTNESS:
+            ret = xmg_driver_set_field(xmg_data, file, XMG_STATE_FIELD_BRIGHTNESS, (int)arg);
+            break;
+
+        case XMG_SET_COLOR:
+            ret = xmg_driver_set_field(xmg_data, file, XMG_STATE_FIELD_COLOR, (int)arg);
+            break;
+
+        case XMG_SET_TIMEOUT:
+            ret = xmg_driver_set_field(xmg_data, file, XMG_STATE_FIELD_TIMEOUT, (int)arg);
+            break;
+
+        case XMG_SET_BOOT:
+            ret = xmg_driver_set_field(xmg_data, file, XMG_STATE_FIELD_BOOT, (int)arg);
+            break;
+
+        case XMG_SET_STATE:
+            if(copy_from_user(&params.state, (void* __user)arg, sizeof(params.state))) {
+                XMG_LOG_ERR(dev, "copy from user failed");
+                ret = -EINVAL;
+                break;
+            }
+
+            if(xmg_file_async(file))
+                ret = xmg_async_queue_state(xmg_data, &params.state);
+            else
+                ret = xmg_driver_apply_state(xmg_data, &params.state);
+
+            if(copy_to_user((void* __user)arg, &params.state, sizeof(params.state))) {
+                XMG_LOG_ERR(dev, "copy to user failed");
+                ret = -EINVAL;
+                break;
+            }
+
+            break;
+
+        case XMG_SET_ASYNC:
+            WRITE_ONCE(((struct xmg_file*)file->private_data)->async, !!arg);
+            break;
+
+        case XMG_GET_STATE:
+            xmg_driver_get_state(xmg_data, &params.info);
+
+            if(copy_to_user((void* __user)arg, &params.info, sizeof(params.info))) {
+                XMG_LOG_ERR(dev, "copy to user failed");
+                ret = -EINVAL;
+                break;
+            }
+
+            break;
+
+        case XMG_SET_EFFECT:
+            if(copy_from_user(&params.effect, (void* __user)arg, sizeof(params.effect))) {
+                XMG_LOG_ERR(dev, "copy from user failed");
+                ret = -EINVAL;
+                break;
+            }
+
+            ret = xmg_effect_upload(xmg_data, &params.effect);
+            break;
+
+        case XMG_CALL_DCHU:
+            if(!capable(CAP_SYS_ADMIN)) {
+                XMG_LOG_ERR(dev, "Access to XMG_CALL_DCHU requires CAP_SYS_ADMIN capability");
+                ret = -EPERM;
+                break;
+            }
+
+            if(copy_from_user(&params.dchu, (void* __user)arg, sizeof(params.dchu))) {
+                XMG_LOG_ERR(dev, "copy from user failed");
+                ret = -EINVAL;
+                break;
+            }
+
+            ret = xmg_driver_call_dchu(dev, &params.dchu);
+
+            // Raw command could have changed anything
+            xmg_driver_invalidate_hw(xmg_data);
+
+            if(copy_to_user((void* __user)arg, &params.dchu, sizeof(params.dchu))) {
+                XMG_LOG_ERR(dev, "copy to user failed");
+                ret = -EINVAL;
+                break;
+            }
+
+            break;
+
+        case XMG_CALL_DCHU_BATCH:
+            if(!capable(CAP_SYS_ADMIN)) {
+                XMG_LOG_ERR(dev, "Access to XMG_CALL_DCHU_BATCH requires CAP_SYS_ADMIN capability");
+                ret = -EPERM;
+                break;
+            }
+
+            if(copy_from_user(&params.batch, (void* __user)arg, sizeof(params.batch))) {
+                XMG_LOG_ERR(dev, "copy from user failed");
+                ret = -EINVAL;
+                break;
+            }
+
+            ret = xmg_driver_call_dchu_batch(dev, &params.batch);
+
+            // Raw commands could have changed anything
+            xmg_driver_invalidate_hw(xmg_data);
+
+            if(copy_to_user((void* __user)arg, &params.batch, sizeof(params.batch))) {
+                XMG_LOG_ERR(dev, "copy to user failed");
+                ret = -EINVAL;
+                break;
+            }
+
+            break;
+
+        default:
+            XMG_LOG_ERR(dev, "Invalid IOCTL code (%d)",  cmd);
+            ret = -ENOTSUPP;
+            break;
+    }
+
+    xmg_file_leave(xmg_data);
+    return ret;
+}
+
+/*
+ * Wait until all requests queued by asynchronous mode are applied
+ *  - returns error of the last failed request (if any)
+ */
+static int xmg_driver_fsync(struct file* file, loff_t start, loff_t end, int datasync) {
+    struct xmg_data* xmg_data = xmg_file_data(file);
+    int ret;
+
+    ret = xmg_file_enter(xmg_data);
+    if(ret)
+        return ret;
+
+    flush_delayed_work(&xmg_data->async_work);
+    xmg_file_leave(xmg_data);
+
+    spin_lock(&xmg_data->async_lock);
+    ret = xmg_data->async_error;
+    xmg_data->async_error = 0;
+    spin_unlock(&xmg_data->async_lock);
+
+    return ret;
+}
+
+/*
+ * IO_URING PASSTHROUGH
+ *  - request is validated and its input copied at submission, _DSM calls
+ *    are done from uring_wq in submission order, results are copied back to userspace
+ *    from task work of the submitter
+ */
+struct xmg_uring_req {
+    struct work_struct work;
+    struct io_uring_cmd* ioucmd;
+    struct xmg_data* xmg;
+    unsigned int op;
+    void __user* uarg;
+    int ret;
+
+    union {
+        struct {
+            enum xmg_state_field field;
+            int value;
+        };
+        struct xmg_state state;
+        struct {
+            struct xmg_dchu dchu;
+            char* buffer;
+            struct acpi_buffer output;
+        };
+    };
+};
+
+static inline struct xmg_uring_req** xmg_uring_pdu(struct io_uring_cmd* ioucmd) {
+    BUILD_BUG_ON(sizeof(struct xmg_uring_req*) > sizeof(ioucmd->pdu));
+    return (struct xmg_uring_req**)ioucmd->pdu;
+}
+
+static void xmg_uring_req_free(struct xmg_uring_req* req) {
+    if(req->op == XMG_CALL_DCHU) {
+        kfree(req->output.pointer);
+        kfree(req->buffer);
+    }
+
+    // Completion may run after the device was unbound
+    put_device(&req->xmg->pdev->dev);
+    xmg_data_put(req->xmg);
+    kfree(req);
+}
+
+// Runs in context of the submitting task - safe to access its memory
+static void xmg_uring_complete(struct io_uring_cmd* ioucmd, unsigned int issue_flags) {
+    struct xmg_uring_req* req = *xmg_uring_pdu(ioucmd);
+    struct device* dev = &req->xmg->pdev->dev;
+    int ret = req->ret;
+
+    switch(req->op) {
+        case XMG_SET_STATE:
+            if(copy_to_user(req->uarg, &req->state, sizeof(req->state))) {
+                XMG_LOG_ERR_RL(dev, "copy to user failed");
+                ret = -EINVAL;
+            }
+            break;
+
+        case XMG_CALL_DCHU:
+            if(!ret)
+                ret = xmg_dchu_copy_output(dev, &req->output, req->dchu.ubuf, &req->dchu.length);
+            if(ret)
+                atomic_inc(&req->xmg->dchu_errors);
+
+            if(copy_to_user(req->uarg, &req->dchu, sizeof(req->dchu))) {
+                XMG_LOG_ERR_RL(dev, "copy to user failed");
+                ret = -EINVAL;
+            }
+            break;
+    }
+
+    xmg_uring_req_free(req);
+    io_uring_cmd_done(ioucmd, ret, 0, issue_flags);
+}
+
+static void xmg_uring_work(struct work_struct* work) {
+    struct xmg_uring_req* req = container_of(work, struct xmg_uring_req, work);
+    struct xmg_data* xmg = req->xmg;
+    struct xmg_state state = {0};
+
+    // Don't race with state restore queued after resume
+    xmg_driver_flush_pending(xmg);
+
+    switch(req->op) {
+        case XMG_SET_BRIGHTNESS:
+        case XMG_SET_COLOR:
+        case XMG_SET_TIMEOUT:
+        case XMG_SET_BOOT:
+            state.mask = BIT(req->field);
+            *xmg_state_field(&state, req->field) = req->value;
+            req->ret = xmg_driver_apply_state(xmg, &state);
+            break;
+
+        case XMG_SET_STATE:
+            req->ret = xmg_driver_apply_state(xmg, &req->state);
+            break;
+
+        case XMG_CALL_DCHU:
+            req->ret = xmg_acpi_call(&xmg->pdev->dev, req->dchu.cmd,
+                        req->buffer, req->dchu.length, &req->output);
+
+            // Raw command could have changed anything
+            xmg_driver_invalidate_hw(xmg);
+            break;
+    }
+
+    io_uring_cmd_complete_in_task(req->ioucmd, xmg_uring_complete);
+}
+
+static int xmg_uring_prepare_dchu(struct xmg_uring_req* req) {
+    struct device* dev = &req->xmg->pdev->dev;
+
+    if(!capable(CAP_SYS_ADMIN)) {
+        XMG_LOG_ERR_RL(dev, "Access to XMG_CALL_DCHU requires CAP_SYS_ADMIN capability");
+        return -EPERM;
+    }
+
+    if(copy_from_user(&req->dchu, req->uarg, sizeof(req->dchu))) {
+        XMG_LOG_ERR_RL(dev, "copy from user failed");
+        return -EINVAL;
+    }
+
+    if(!req->dchu.length || req->dchu.length > XMG_MAX_DCHU_LENGTH)
+        return -EINVAL;
+
+    req->buffer = memdup_user(req->dchu.ubuf, req->dchu.length);
+    if(IS_ERR(req->buffer)) {
+        int ret = PTR_ERR(req->buffer);
+
+        req->buffer = NULL;
+        return ret;
+    }
+    return 0;
+}
+
+static int xmg_driver_uring_cmd(struct io_uring_cmd* ioucmd, unsigned int issue_flags) {
+    struct xmg_data* xmg = xmg_file_data(ioucmd->file);
+    const struct xmg_uring_cmd* cmd = io_uring_sqe_cmd(ioucmd->sqe);
+    struct device* dev = &xmg->pdev->dev;
+    struct xmg_uring_req* req;
+    int ret = 0;
+
+    // Held until the request is queued - uring_wq is destroyed by remove
+    ret = xmg_file_enter(xmg);
+    if(ret)
+        return ret;
+
+    req = kzalloc(sizeof(*req), GFP_KERNEL);
+    if(!req) {
+        ret = -ENOMEM;
+        goto leave;
+    }
+
+    INIT_WORK(&req->work, xmg_uring_work);
+    req->ioucmd = ioucmd;
+    req->xmg = xmg;
+    kref_get(&xmg->ref);
+    get_device(&xmg->pdev->dev);
+    req->op = ioucmd->cmd_op;
+    req->uarg = u64_to_user_ptr(READ_ONCE(cmd->arg));
+
+    switch(req->op) {
+        case XMG_SET_BRIGHTNESS:
+            req->field = XMG_STATE_FIELD_BRIGHTNESS;
+            req->value = (int)(unsigned long)req->uarg;
+            break;
+
+        case XMG_SET_COLOR:
+            req->field = XMG_STATE_FIELD_COLOR;
+            req->value = (int)(unsigned long)req->uarg;
+            break;
+
+        case XMG_SET_TIMEOUT:
+            req->field = XMG_STATE_FIELD_TIMEOUT;
+            req->value = (int)(unsigned long)req->uarg;
+            break;
+
+        case XMG_SET_BOOT:
+            req->field = XMG_STATE_FIELD_BOOT;
+            req->value = (int)(unsigned long)req->uarg;
+            break;
+
+        case XMG_SET_STATE:
+            if(copy_from_user(&req->state, req->uarg, sizeof(req->state))) {
+                XMG_LOG_ERR_RL(dev, "copy from user failed");
+                ret = -EINVAL;
+            }
+            break;
+
+        case XMG_CALL_DCHU:
+            ret = xmg_uring_prepare_dchu(req);
+            break;
+
+        default:
+            XMG_LOG_ERR_RL(dev, "Invalid uring command code (%d)", req->op);
+            ret = -ENOTSUPP;
+            break;
+    }
+
+    if(ret) {
+        xmg_uring_req_free(req);
+        goto leave;
+    }
+
+    *xmg_uring_pdu(ioucmd) = req;
+    queue_work(xmg->uring_wq, &req->work);
+    ret = -EIOCBQUEUED;
+
+leave:
+    xmg_file_leave(xmg);
+    return ret;
+}
+
+static int xmg_uring_init(struct xmg_data* xmg) {
+    // Ordered, so that requests reach the keyboard in submission order
+    //  (same as IOCTLs). Freezable, so that queued requests don't reach
+    //  the keyboard during suspend
+    xmg->uring_wq = alloc_ordered_workqueue("xmg_uring", WQ_FREEZABLE);
+    if(!xmg->uring_wq)
+        return -ENOMEM;
+    return 0;
+}
+
+static void xmg_uring_remove(struct xmg_data* xmg) {
+    // Executes all queued requests before returning - their completions
+    //  pin xmg_data on their own
+    destroy_workqueue(xmg->uring_wq);
+}
+
+static const struct file_operations xmg_driver_fops = {
+    .owner  = THIS_MODULE,
+    .open = xmg_driver_open,
+    .release = xmg_driver_release,
+    .read = xmg_driver_read,
+    .poll = xmg_driver_poll,
+    .unlocked_ioctl = xmg_driver_ioctl,
+    .fsync = xmg_driver_fsync,
+    .uring_cmd = xmg_driver_uring_cmd,
+};
+
+
+/*
+ *	DEBUGFS
+ */
+
+// Upper bound of the bucket containing given percentile
+static u64 xmg_stats_percentile(struct xmg_cmd_stats* stats, unsigned int percent) {
+    u64 seen = 0, target = div_u64(stats->calls * percent + 99, 100);
+    unsigned int bucket;
+
+    for(bucket = 0; bucket < XMG_STATS_BUCKETS; bucket++) {
+        seen += stats->histogram[bucket];
+        if(seen >= target)
+            break;
+    }
+    return 2ull << min(bucket, XMG_STATS_BUCKETS - 1u);
+}
+
+static int xmg_dsm_stats_show(struct seq_file* s, void* unused) {
+    struct xmg_data* xmg = s->private;
+    struct xmg_cmd_stats* stats;
+    unsigned int cmd, bucket;
+
+    seq_printf(s, "%-6s %10s %8s %10s %10s %10s %10s %10s\n",
+        "cmd", "calls", "errors", "min_ns", "avg_ns", "max_ns", "p50_ns", "p99_ns");
+
+    mutex_lock(&xmg->acpi_lock);
+    for(cmd = 0; cmd < XMG_STATS_COMMANDS; cmd++) {
+        stats = &xmg->acpi_stats[cmd];
+        if(!stats->calls)
+            continue;
+
+        if(cmd == XMG_STATS_COMMANDS - 1)
+            seq_printf(s, "%-6s", "other");
+        else
+            seq_printf(s, "%-6u", cmd);
+
+        seq_printf(s, " %10llu %8llu %10llu %10llu %10llu %10llu %10llu\n",
+            stats->calls, stats->errors, stats->min_ns,
+            div64_u64(stats->total_ns, stats->calls), stats->max_ns,
+            xmg_stats_percentile(stats, 50), xmg_stats_percentile(stats, 99));
+
+        seq_puts(s, "       histogram:");
+        for(bucket = 0; bucket < XMG_STATS_BUCKETS; bucket++)
+            if(stats->histogram[bucket])
+                seq_printf(s, " 2^%u:%u", bucket, stats->histogram[bucket]);
+        seq_puts(s, "\n");
+    }
+    mutex_unlock(&xmg->acpi_lock);
+
+    return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(xmg_dsm_stats);
 
-static int xmg_driver_set_boot(struct device* dev, int mode) {
-    int ret = 0;
-    int enc_mode = (KEYBOARD_BOOT_MAGIC << 24) | (!!mode);
+static int xmg_errors_show(struct seq_file* s, void* unused) {
+    struct xmg_data* xmg = s->private;
 
-    ret = xmg_acpi_call(dev, KEYBOARD_DCHU_COMMAND_2, (char*)&enc_mode, sizeof(enc_mode), NULL);
-    return ret;
+    seq_printf(s, "hwmon_errors: %d\n", atomic_read(&xmg->hwmon_errors));
+    seq_printf(s, "fan_stalled: %d\n", atomic_read(&xmg->fan_stalled));
+    seq_printf(s, "dchu_errors: %d\n", atomic_read(&xmg->dchu_errors));
+    return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(xmg_errors);
 
-/*
- * HWMON SUPPORT
- */
-struct xmg_fan_acpi_response {
-    u8      reserved1[2];
-    u16     cpu_rpm;
-    u16     gpu_rpm;
-    u16     gpu2_rpm;
-    u8      reserved2[8];
-
-    u8      cpu_duty;
-    u8      reserved3[1];
-    u8      cpu_temp;
-    u8      gpu_duty;
-    u8      reserved4[1];
-    u8      gpu_temp;
-    u8      gpu2_duty;
-    u8      reserved5[1];
-    u8      gpu2_temp;
-} __PACKED__;
+static int xmg_contention_show(struct seq_file* s, void* unused) {
+    struct xmg_data* xmg = s->private;
 
+    seq_printf(s, "acpi_contended: %d\n", atomic_read(&xmg->acpi_contended));
+    seq_printf(s, "fan_shared: %d\n", atomic_read(&xmg->fan_shared));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(xmg_contention);
 
-static int xmg_fan_get_data(struct device* dev, struct xmg_fan_acpi_response* fan_data) {
-    int ret = 0;
-    char empty_input[0x10] = {0};
-    union acpi_object* acpi_obj;
-    struct acpi_buffer acpi_output = {0};
+static void xmg_debugfs_init(struct xmg_data* xmg) {
+    char name[64];
 
-    ret = xmg_acpi_call(dev, FAN_DCHU_COMMAND_GET, empty_input, 0, &acpi_output);
-    if(ret)
-        goto exit;
-    
-    /*
-     * acpi_output contains pointer to acpi_object
-     */
-    acpi_obj = acpi_output.pointer;
+    snprintf(name, sizeof(name), "xmg_driver-%s", dev_name(&xmg->pdev->dev));
+    xmg->debugfs = debugfs_create_dir(name, NULL);
 
-    if(acpi_obj->type != ACPI_TYPE_BUFFER) {
-        XMG_LOG_ERR(dev, "got invalid ACPI buffer type (%d, expected: %d)",
-            acpi_obj->type, ACPI_TYPE_BUFFER);
-        ret = -EFAULT;
-        goto exit;
-    }
+    debugfs_create_file("dsm_stats", 0400, xmg->debugfs, xmg, &xmg_dsm_stats_fops);
+    debugfs_create_file("errors", 0400, xmg->debugfs, xmg, &xmg_errors_fops);
+    debugfs_create_file("contention", 0400, xmg->debugfs, xmg, &xmg_contention_fops);
+}
 
-    if(acpi_obj->buffer.length < sizeof(struct xmg_fan_acpi_response)) {
-        XMG_LOG_ERR(dev, "got invalid ACPI buffer size (%d, expected min.: %lu)",
-            acpi_obj->buffer.length, sizeof(struct xmg_fan_acpi_response));
-        ret = -EFAULT;
-        goto exit;
-    }
+static void xmg_debugfs_remove(struct xmg_data* xmg) {
+    debugfs_remove_recursive(xmg->debugfs);
+}
 
-    memcpy(fan_data, acpi_obj->buffer.pointer, sizeof(*fan_data));
 
-    // Fix endianess
-    fan_data->cpu_rpm = be16_to_cpu(fan_data->cpu_rpm);
-    fan_data->gpu_rpm = be16_to_cpu(fan_data->gpu_rpm);
-    fan_data->gpu2_rpm = be16_to_cpu(fan_data->gpu2_rpm);
+/*
+ *	PLATFORM DEVICE ATTRIBUTES
+ */
+static ssize_t async_coalesced_show(struct device* dev, struct device_attribute* attr, char* buf) {
+    struct xmg_data* xmg = dev_get_drvdata(dev);
 
-exit:
-    kfree(acpi_output.pointer);
-    return ret;
+    return sprintf(buf, "%d\n", atomic_read(&xmg->async_coalesced));
 }
 
-static ssize_t xmg_hwmon_temp_show(struct device* hwdev,
-                  struct device_attribute* devattr, char* buf) {
-    int index = to_sensor_dev_attr(devattr)->index;
-    struct xmg_data* xmg = dev_get_drvdata(hwdev);
-    struct device* dev = &xmg->pdev->dev;
+static ssize_t async_dropped_show(struct device* dev, struct device_attribute* attr, char* buf) {
+    struct xmg_data* xmg = dev_get_drvdata(dev);
 
-    struct xmg_fan_acpi_response fan_data;
-    int temperature, ret = 0;
+    return sprintf(buf, "%d\n", atomic_read(&xmg->async_dropped));
+}
 
-    ret = xmg_fan_get_data(dev, &fan_data);
-    if(ret != 0) {
-        XMG_LOG_ERR(dev, "failed to get fan_data (ret=%d)", ret);
-        return ret;
-    }
+static ssize_t effect_skipped_show(struct device* dev, struct device_attribute* attr, char* buf) {
+    struct xmg_data* xmg = dev_get_drvdata(dev);
 
-    if(index == 0)
-        temperature = fan_data.cpu_temp;
-    else if(index == 1)
-        temperature = fan_data.gpu_temp;
-    else {
-        XMG_LOG_ERR(dev, "invalid sensor index (%d)", index);
-        return -EINVAL;
-    }
-    return sprintf(buf, "%d\n", temperature * 1000);
+    return sprintf(buf, "%d\n", atomic_read(&xmg->effect_skipped));
 }
 
-static ssize_t xmg_hwmon_temp_label_show(struct device* hwdev,
-                    struct device_attribute* devattr, char* buf) {
-    int index = to_sensor_dev_attr(devattr)->index;
+static ssize_t iio_cached_scans_show(struct device* dev, struct device_attribute* attr, char* buf) {
+    struct xmg_data* xmg = dev_get_drvdata(dev);
 
-    static const char* XMG_TEMP_LABELS[] = {
-        "CPU Temp",
-        "GPU Temp",
-    };
+    return sprintf(buf, "%d\n", atomic_read(&xmg->iio_cached_scans));
+}
 
-    if(index < 0 || index >= ARRAY_SIZE(XMG_TEMP_LABELS))
-        return -EINVAL;
+static ssize_t init_latency_us_show(struct device* dev, struct device_attribute* attr, char* buf) {
+    struct xmg_data* xmg = dev_get_drvdata(dev);
 
-    return sprintf(buf, "%s\n", XMG_TEMP_LABELS[index]);
+    return sprintf(buf, "%lld\n", READ_ONCE(xmg->init_latency_us));
 }
 
-/*
-* Convert value returned by ACPI call to rotations per minute (RPM)
-*  - this formula is equivalent to `2 * 60 / (128 / 23 * acpi_value)`
-*/
-#define XMG_ACPI_RPM_TO_REAL(X) (2156250ull / (unsigned long long) X)
+static ssize_t resume_latency_us_show(struct device* dev, struct device_attribute* attr, char* buf) {
+    struct xmg_data* xmg = dev_get_drvdata(dev);
 
-static ssize_t xmg_hwmon_fan_show(struct device* hwdev,
-                  struct device_attribute* devattr, char* buf)
-{
-    int index = to_sensor_dev_attr(devattr)->index;
-    struct xmg_data* xmg = dev_get_drvdata(hwdev);
-    struct device* dev = &xmg->pdev->dev;
+    return sprintf(buf, "%lld\n", READ_ONCE(xmg->resume_latency_us));
+}
 
-    struct xmg_fan_acpi_response fan_data;
-    int fan_speed, ret = 0;
+static ssize_t skipped_writes_show(struct device* dev, struct device_attribute* attr, char* buf) {
+    struct xmg_data* xmg = dev_get_drvdata(dev);
 
-    ret = xmg_fan_get_data(dev, &fan_data);
-    if(ret != 0) {
-        XMG_LOG_ERR(dev, "failed to get fan_data (ret=%d)", ret);
-        return ret;
-    }
+    return sprintf(buf, "%d\n", atomic_read(&xmg->skipped_writes));
+}
 
-    if(index == 0)
-        fan_speed = fan_data.cpu_rpm;
-    else if(index == 1)
-        fan_speed = fan_data.gpu_rpm;
-    else {
-        XMG_LOG_ERR(dev, "invalid sensor index (%d)", index);
-        return -EINVAL;
-    }
+static DEVICE_ATTR_RO(async_coalesced);
+static DEVICE_ATTR_RO(async_dropped);
+static DEVICE_ATTR_RO(effect_skipped);
+static DEVICE_ATTR_RO(iio_cached_scans);
+static DEVICE_ATTR_RO(init_latency_us);
+static DEVICE_ATTR_RO(resume_latency_us);
+static DEVICE_ATTR_RO(skipped_writes);
+
+static struct attribute *xmg_stats_attrs[] = {
+    &dev_attr_async_coalesced.attr,
+    &dev_attr_async_dropped.attr,
+    &dev_attr_effect_skipped.attr,
+    &dev_attr_iio_cached_scans.attr,
+    &dev_attr_init_latency_us.attr,
+    &dev_attr_resume_latency_us.attr,
+    &dev_attr_skipped_writes.attr,
+    NULL,
+};
 
-    if(fan_speed == 0) {
-        XMG_LOG_WARN(dev, "CPU Fan RPM is Infinity");
-        return -EFAULT;
-    }
+static const struct attribute_group xmg_stats_group = {
+    .name = "stats",
+    .attrs = xmg_stats_attrs,
+};
+
+/*
+ * Keyboard settings - allow configuring keyboard with a plain write (e.g.
+ *  from udev rules or systemd-tmpfiles)
+ */
+static int xmg_sysfs_apply(struct xmg_data* xmg, struct xmg_state* state) {
+    // Don't race with state restore queued after resume
+    xmg_driver_flush_pending(xmg);
+    return xmg_driver_apply_state(xmg, state);
+}
 
-    fan_speed = XMG_ACPI_RPM_TO_REAL(fan_speed);
-    return sprintf(buf, "%d\n", fan_speed);
+static int xmg_sysfs_store_field(struct device* dev, enum xmg_state_field field, int value) {
+    struct xmg_data* xmg = dev_get_drvdata(dev);
+    struct xmg_state state = { .mask = BIT(field) };
+
+    *xmg_state_field(&state, field) = value;
+    return xmg_sysfs_apply(xmg, &state);
 }
 
-static ssize_t xmg_hwmon_fan_label_show(struct device* hwdev,
-                    struct device_attribute* devattr, char* buf) {
-    int index = to_sensor_dev_attr(devattr)->index;
+// Color is accepted as RRGGBB hex (optionally prefixed with '#')
+static int xmg_sysfs_parse_color(const char* buf, int* color) {
+    unsigned int rgb;
+    int ret;
 
-    static const char* XMG_FAN_LABELS[] = {
-        "CPU Fan",
-        "GPU Fan",
-    };
+    if(*buf == '#')
+        buf++;
 
-    if(index < 0 || index >= ARRAY_SIZE(XMG_FAN_LABELS))
+    ret = kstrtouint(buf, 16, &rgb);
+    if(ret)
+        return ret;
+    if(rgb > 0xffffff)
         return -EINVAL;
-    
-    return sprintf(buf, "%s\n", XMG_FAN_LABELS[index]);
-}
-
-static SENSOR_DEVICE_ATTR_RO(fan1_input, xmg_hwmon_fan, 0);
-static SENSOR_DEVICE_ATTR_RO(fan1_label, xmg_hwmon_fan_label, 0);
-static SENSOR_DEVICE_ATTR_RO(fan2_input, xmg_hwmon_fan, 1);
-static SENSOR_DEVICE_ATTR_RO(fan2_label, xmg_hwmon_fan_label, 1);
-static SENSOR_DEVICE_ATTR_RO(temp1_input, xmg_hwmon_temp, 0);
-static SENSOR_DEVICE_ATTR_RO(temp1_label, xmg_hwmon_temp_label, 0);
-static SENSOR_DEVICE_ATTR_RO(temp2_input, xmg_hwmon_temp, 1);
-static SENSOR_DEVICE_ATTR_RO(temp2_label, xmg_hwmon_temp_label, 1);
-
-static struct attribute *xmg_acpi_attrs[] = {
-    &sensor_dev_attr_fan1_input.dev_attr.attr,      /* 0 - CPU Fan RPM */
-    &sensor_dev_attr_fan1_label.dev_attr.attr,      /* 1 - CPU Fan Label */
-    &sensor_dev_attr_fan2_input.dev_attr.attr,      /* 2 - GPU Fan RPM */
-    &sensor_dev_attr_fan2_label.dev_attr.attr,      /* 3 - GPU Fan Label */
-    &sensor_dev_attr_temp1_input.dev_attr.attr,     /* 4 - CPU Temperature */
-    &sensor_dev_attr_temp1_label.dev_attr.attr,     /* 5 - CPU Temp Label */
-    &sensor_dev_attr_temp2_input.dev_attr.attr,     /* 6 - GPU Temperature */
-    &sensor_dev_attr_temp2_label.dev_attr.attr,     /* 7 - GPU Temp Label */
-    NULL,                                           /* Don't forget about NULL terminator! */
-};
-
 
-static umode_t xmg_acpi_is_visible(struct kobject *kobj, struct attribute *attr, int index) {
-    return attr->mode;
+    *color = KEYBOARD_COLOR_FROM_HEX(rgb);
+    return 0;
 }
 
+static ssize_t brightness_show(struct device* dev, struct device_attribute* attr, char* buf) {
+    struct xmg_data* xmg = dev_get_drvdata(dev);
+    struct xmg_state_info info;
 
-static const struct attribute_group xmg_acpi_group = {
-    .attrs = xmg_acpi_attrs,
-    .is_visible = xmg_acpi_is_visible,
-};
-__ATTRIBUTE_GROUPS(xmg_acpi);
+    xmg_driver_get_state(xmg, &info);
+    return sprintf(buf, "%d\n", info.brightness);
+}
 
-static int xmg_hwmon_init(struct xmg_data* xmg) {
-    int ret = 0;
+static ssize_t brightness_store(struct device* dev, struct device_attribute* attr,
+                    const char* buf, size_t count) {
+    int value, ret;
 
-    xmg->hdev = hwmon_device_register_with_groups(NULL, "xmg_acpi", xmg, xmg_acpi_groups);
-    if(IS_ERR(xmg->hdev))
-        ret = PTR_ERR(xmg->hdev);
-    return ret;
+    ret = kstrtoint(buf, 0, &value);
+    if(ret)
+        return ret;
+
+    ret = xmg_sysfs_store_field(dev, XMG_STATE_FIELD_BRIGHTNESS, value);
+    return ret ? : count;
 }
 
-static void xmg_hwmon_remove(struct xmg_data* xmg) {
-    hwmon_device_unregister(xmg->hdev);
+static ssize_t color_show(struct device* dev, struct device_attribute* attr, char* buf) {
+    struct xmg_data* xmg = dev_get_drvdata(dev);
+    struct xmg_state_info info;
+
+    xmg_driver_get_state(xmg, &info);
+    return sprintf(buf, "%06x\n", KEYBOARD_COLOR_TO_HEX(info.color));
 }
 
+static ssize_t color_store(struct device* dev, struct device_attribute* attr,
+                    const char* buf, size_t count) {
+    int value, ret;
 
-/*
- * MISC
- */
-static int xmg_driver_call_dchu(struct device* dev, struct xmg_dchu* dchu) {
-    int ret = 0;
-    char* kernel_buffer = NULL;
-    struct acpi_buffer acpi_output = {0};
-    union acpi_object* acpi_obj = NULL;
-    
-    if(!dchu->length || dchu->length > 4096)
-        return -EINVAL;
+    ret = xmg_sysfs_parse_color(buf, &value);
+    if(ret)
+        return ret;
 
-    kernel_buffer = kmalloc(dchu->length, GFP_KERNEL);
-    if(!kernel_buffer)
-        return -ENOMEM;
+    ret = xmg_sysfs_store_field(dev, XMG_STATE_FIELD_COLOR, value);
+    return ret ? : count;
+}
 
-    if(copy_from_user(kernel_buffer, dchu->ubuf, dchu->length)) {
-        XMG_LOG_ERR(dev, "copy from user failed");
-        ret = -EINVAL;
-        goto exit;
-    }
+static ssize_t timeout_show(struct device* dev, struct device_attribute* attr, char* buf) {
+    struct xmg_data* xmg = dev_get_drvdata(dev);
+    struct xmg_state_info info;
 
-    ret = xmg_acpi_call(dev, dchu->cmd, kernel_buffer, dchu->length, &acpi_output);
-    if(ret)
-        goto exit;
+    xmg_driver_get_state(xmg, &info);
+    return sprintf(buf, "%d\n", info.timeout);
+}
 
-    /*
-     * Despite type, acpi_output contains pointer to kernel object acpi_object
-     *   we need to copy only its content to user
-     */
-    acpi_obj = acpi_output.pointer;
-    if(acpi_obj->type == ACPI_TYPE_BUFFER) {
-        size_t acpi_buffer_size = acpi_obj->buffer.length;
-
-        if(acpi_buffer_size > dchu->length) {
-            XMG_LOG_WARN(dev, "ACPI output (%lu) is larger than provided buffer size (%d) - "
-                    "result will be truncated!", acpi_buffer_size, dchu->length);
-            acpi_buffer_size = dchu->length;
-            ret = -E2BIG;
-        }
+static ssize_t timeout_store(struct device* dev, struct device_attribute* attr,
+                    const char* buf, size_t count) {
+    int value, ret;
 
-        if(copy_to_user(dchu->ubuf, acpi_obj->buffer.pointer, acpi_buffer_size)) {
-            XMG_LOG_ERR(dev, "copy to user failed");
-            ret = -EINVAL;
-            goto exit;
-        }
+    ret = kstrtoint(buf, 0, &value);
+    if(ret)
+        return ret;
 
-        // Length now shows the size of saved output
-        dchu->length = acpi_buffer_size;
-    } else {
-        XMG_LOG_ERR(dev, "ACPI output contains unsupported type (%u)", acpi_obj->type);
-        ret = -ENOTSUPP;
-        goto exit;
-    }
-exit:
-    kfree(acpi_output.pointer);
-    kfree(kernel_buffer);
-    return ret;
+    ret = xmg_sysfs_store_field(dev, XMG_STATE_FIELD_TIMEOUT, value);
+    return ret ? : count;
 }
 
-/*
- *	FILE OPERATIONS IMPLEMENTATION
- */
-static long xmg_driver_ioctl(struct file* file, unsigned int cmd, unsigned long __user arg) {
-    int ret = 0;
-    struct xmg_data* xmg_data = container_of(file->private_data, struct xmg_data, mdev);
-    struct device* dev = &xmg_data->pdev->dev;
-    union {
-        struct xmg_dchu dchu;
-    } params;
+static ssize_t boot_show(struct device* dev, struct device_attribute* attr, char* buf) {
+    struct xmg_data* xmg = dev_get_drvdata(dev);
+    struct xmg_state_info info;
 
-    switch(cmd) {
-        case XMG_SET_BRIGHTNESS:
-            ret = xmg_driver_set_brightness(dev, (int)arg);
-            if(ret)
-                break;
+    xmg_driver_get_state(xmg, &info);
+    return sprintf(buf, "%d\n", info.boot);
+}
 
-            atomic_set(&xmg_data->brightness, (int)arg);
-            break;
+// Any true value overwrites boot effect with current settings
+static ssize_t boot_store(struct device* dev, struct device_attribute* attr,
+                    const char* buf, size_t count) {
+    bool value;
+    int ret;
 
-        case XMG_SET_COLOR:
-            ret = xmg_driver_set_color(dev, (int)arg);
-            if(ret)
-                break;
-                
-            atomic_set(&xmg_data->color, (int)arg);
-            break;
+    ret = kstrtobool(buf, &value);
+    if(ret)
+        return ret;
+    if(!value)
+        return -EINVAL;
 
-        case XMG_SET_TIMEOUT:
-            ret = xmg_driver_set_timeout(dev, (int)arg);
-            if(ret)
-                break;
-                
-            atomic_set(&xmg_data->timeout, (int)arg);
-            break;
+    ret = xmg_sysfs_store_field(dev, XMG_STATE_FIELD_BOOT, 1);
+    return ret ? : count;
+}
 
-        case XMG_SET_BOOT:
-            ret = xmg_driver_set_boot(dev, (int)arg);          
-            break;
+static ssize_t state_show(struct device* dev, struct device_attribute* attr, char* buf) {
+    struct xmg_data* xmg = dev_get_drvdata(dev);
+    struct xmg_state_info info;
 
-        case XMG_CALL_DCHU:
-            if(!capable(CAP_SYS_ADMIN)) {
-                XMG_LOG_ERR(dev, "Access to XMG_CALL_DCHU requires CAP_SYS_ADMIN capability");
-                ret = -EPERM;
-                break;
-            }
+    xmg_driver_get_state(xmg, &info);
+    return sprintf(buf, "brightness=%d color=%06x timeout=%d boot=%d generation=%u\n",
+        info.brightness, KEYBOARD_COLOR_TO_HEX(info.color), info.timeout, info.boot, info.generation);
+}
 
-            if(copy_from_user(&params.dchu, (void* __user)arg, sizeof(params.dchu))) {
-                XMG_LOG_ERR(dev, "copy from user failed");
-                ret = -EINVAL;
-                break;
-            }
+/*
+ * Accepts whitespace or comma separated key=value pairs - all of them are
+ *  validated and applied in one pass, e.g. "brightness=100 color=ff0000".
+ *  Key force=1 resends values which keyboard is known to hold already.
+ */
+static ssize_t state_store(struct device* dev, struct device_attribute* attr,
+                    const char* buf, size_t count) {
+    struct xmg_data* xmg = dev_get_drvdata(dev);
+    struct xmg_state state = {0};
+    char *copy, *cursor, *token, *value;
+    bool flag;
+    int ret = 0;
 
-            ret = xmg_driver_call_dchu(dev, &params.dchu);
+    copy = kstrndup(buf, count, GFP_KERNEL);
+    if(!copy)
+        return -ENOMEM;
 
-            if(copy_to_user((void* __user)arg, &params.dchu, sizeof(params.dchu))) {
-                XMG_LOG_ERR(dev, "copy to user failed");
-                ret = -EINVAL;
-                break;
-            }
+    cursor = copy;
+    while((token = strsep(&cursor, " \t\n,")) != NULL) {
+        if(!*token)
+            continue;
 
+        value = strchr(token, '=');
+        if(!value) {
+            ret = -EINVAL;
             break;
+        }
+        *value++ = '\0';
+
+        if(!strcmp(token, "brightness")) {
+            state.mask |= XMG_STATE_BRIGHTNESS;
+            ret = kstrtoint(value, 0, &state.brightness);
+        } else if(!strcmp(token, "color")) {
+            state.mask |= XMG_STATE_COLOR;
+            ret = xmg_sysfs_parse_color(value, &state.color);
+        } else if(!strcmp(token, "timeout")) {
+            state.mask |= XMG_STATE_TIMEOUT;
+            ret = kstrtoint(value, 0, &state.timeout);
+        } else if(!strcmp(token, "boot")) {
+            ret = kstrtobool(value, &flag);
+            if(!ret && flag) {
+                state.mask |= XMG_STATE_BOOT;
+                state.boot = 1;
+            }
+        } else if(!strcmp(token, "force")) {
+            ret = kstrtobool(value, &flag);
+            if(!ret && flag)
+                state.mask |= XMG_STATE_FORCE;
+        } else
+            ret = -EINVAL;
 
-        default:
-            XMG_LOG_ERR(dev, "Invalid IOCTL code (%d)",  cmd);
-            ret = -ENOTSUPP;
+        if(ret)
             break;
     }
+    kfree(copy);
 
-    return ret;
+    if(ret)
+        return ret;
+
+    ret = xmg_sysfs_apply(xmg, &state);
+    return ret ? : count;
 }
 
-static const struct file_operations xmg_driver_fops = {
-    .owner  = THIS_MODULE,
-    .unlocked_ioctl = xmg_driver_ioctl
+static DEVICE_ATTR_RW(brightness);
+static DEVICE_ATTR_RW(color);
+static DEVICE_ATTR_RW(timeout);
+static DEVICE_ATTR_RW(boot);
+static DEVICE_ATTR_RW(state);
+
+static struct attribute *xmg_keyboard_attrs[] = {
+    &dev_attr_brightness.attr,
+    &dev_attr_color.attr,
+    &dev_attr_timeout.attr,
+    &dev_attr_boot.attr,
+    &dev_attr_state.attr,
+    NULL,
+};
+
+static const struct attribute_group xmg_keyboard_group = {
+    .attrs = xmg_keyboard_attrs,
+};
+
+static const struct attribute_group *xmg_driver_groups[] = {
+    &xmg_keyboard_group,
+    &xmg_stats_group,
+    NULL,
 };
 
 
@@ -496,9 +3037,12 @@ static int xmg_driver_probe(struct platform_device *pdev) {
     struct xmg_data *drv;
     int ret;
 
-    drv = kmalloc(sizeof(struct xmg_data), GFP_KERNEL);
+    drv = kzalloc(sizeof(struct xmg_data), GFP_KERNEL);
     if (!drv)
         return -ENOMEM;
+    kref_init(&drv->ref);
+    init_rwsem(&drv->remove_lock);
+    drv->probe_time = ktime_get();
 
     platform_set_drvdata(pdev, drv);
     drv->pdev = pdev;
@@ -508,29 +3052,103 @@ static int xmg_driver_probe(struct platform_device *pdev) {
     drv->mdev.minor  = MISC_DYNAMIC_MINOR;
     drv->mdev.parent = NULL;
 
+    ret = xmg_acpi_arena_init(drv);
+    if(ret) {
+        XMG_LOG_ERR(&pdev->dev, "failed to allocate _DSM arguments");
+        goto drv_free;
+    }
+
+    ret = xmg_async_init(drv);
+    if(ret) {
+        XMG_LOG_ERR(&pdev->dev, "failed to create workqueue");
+        goto arena_free;
+    }
+
+    mutex_init(&drv->state_lock);
+    seqcount_mutex_init(&drv->state_seq, &drv->state_lock);
+    drv->hw_valid = 0;
+
+    xmg_effect_init(drv);
+    INIT_WORK(&drv->restore_work, xmg_restore_work);
+    INIT_WORK(&drv->init_work, xmg_init_work);
+
+    ret = xmg_uring_init(drv);
+    if(ret) {
+        XMG_LOG_ERR(&pdev->dev, "failed to create io_uring workqueue");
+        goto async_remove;
+    }
+
+    // Must be ready before the first open() of the device
+    ret = xmg_events_init(drv);
+    if(ret)
+        goto uring_remove;
+
     ret = misc_register(&drv->mdev);
     if (ret) {
         XMG_LOG_ERR(&pdev->dev, "failed to create miscdev");
-        return ret;
+        goto events_remove;
     }
 
-    atomic_set(&drv->brightness, 0);
-    atomic_set(&drv->color, 0);
-    atomic_set(&drv->timeout, 0);
+    atomic_set(&drv->hwmon_errors, 0);
+    atomic_set(&drv->fan_stalled, 0);
+    atomic_set(&drv->dchu_errors, 0);
+    atomic_set(&drv->skipped_writes, 0);
 
-    // Setup cooling device for CPU fan
+    mutex_init(&drv->fan_lock);
+    drv->fan_data_valid = false;
+    drv->update_interval = FAN_DEFAULT_UPDATE_INTERVAL;
+
+    // Setup hwmon device exposing fans and temperatures
     ret = xmg_hwmon_init(drv);
     if(ret) {
         XMG_LOG_ERR(&drv->pdev->dev, "failed to register hwmon device - err: %d", ret);
         goto misc_unreg;
     }
-    
+
+    // ...and thermal zones, so that thermal governors can react on the same readings
+    ret = xmg_thermal_init(drv);
+    if(ret) {
+        XMG_LOG_ERR(&drv->pdev->dev, "failed to register thermal zones - err: %d", ret);
+        goto hwmon_remove;
+    }
+
+    ret = xmg_led_init(drv);
+    if(ret) {
+        XMG_LOG_ERR(&drv->pdev->dev, "failed to register LED device - err: %d", ret);
+        goto thermal_remove;
+    }
+
+    ret = xmg_iio_init(drv);
+    if(ret) {
+        XMG_LOG_ERR(&drv->pdev->dev, "failed to register IIO device - err: %d", ret);
+        goto led_remove;
+    }
+
+    xmg_debugfs_init(drv);
+
+    // Don't hold probe for ACPI calls setting initial state
+    queue_work(drv->wq, &drv->init_work);
 
     XMG_LOG_INFO(&pdev->dev, "registered (v.%s)", XMGDriverVersionStr);
     return 0;
 
+led_remove:
+    xmg_led_remove(drv);
+thermal_remove:
+    xmg_thermal_remove(drv);
+hwmon_remove:
+    xmg_hwmon_remove(drv);
 misc_unreg:
     misc_deregister(&drv->mdev);
+events_remove:
+    xmg_events_remove(drv);
+uring_remove:
+    xmg_uring_remove(drv);
+async_remove:
+    xmg_async_remove(drv);
+arena_free:
+    xmg_acpi_arena_free(drv);
+drv_free:
     kfree(drv);
     return ret;
 }
@@ -538,41 +3156,62 @@ misc_unreg:
 static int xmg_driver_remove(struct platform_device *pdev) {
     struct xmg_data *drv = platform_get_drvdata(pdev);
 
+    // Files which are still open keep xmg_data alive, but must not touch
+    //  anything torn down below - wait for operations in progress and
+    //  wake up blocked readers, so they see the device is gone
+    down_write(&drv->remove_lock);
+    drv->dead = true;
+    up_write(&drv->remove_lock);
+    wake_up_all(&drv->event_wq);
+
+    xmg_debugfs_remove(drv);
+    xmg_iio_remove(drv);
+    xmg_led_remove(drv);
+    xmg_thermal_remove(drv);
     xmg_hwmon_remove(drv);
 
     misc_deregister(&drv->mdev);
-    kfree(drv);
+    xmg_events_remove(drv);
+    xmg_uring_remove(drv);
+    cancel_work_sync(&drv->init_work);
+    cancel_work_sync(&drv->restore_work);
+    xmg_effect_remove(drv);
+    xmg_async_remove(drv);
+    xmg_acpi_arena_free(drv);
+    xmg_data_put(drv);
 
     XMG_LOG_INFO(&pdev->dev, "unregistered");
     return 0;
 }
 
-// Function invoked after resume from suspend
-//  Set up keyboard color as it it lost after each suspend/power-off
-static int xmg_driver_resume(struct device *device) {
-    int ret;
+// Function invoked before suspend
+//  Stop effect engine, so it doesn't talk to the keyboard while suspending
+static int xmg_driver_suspend(struct device *device) {
     struct xmg_data *drv = dev_get_drvdata(device);
-    struct device* dev = &drv->pdev->dev;
-    int color = atomic_read(&drv->color);
-    int timeout = atomic_read(&drv->timeout);
 
-    if(color) {
-        ret = xmg_driver_set_color(dev, color);
-        if(ret)
-            XMG_LOG_ERR(dev, "failed to set color after resume");
-    }
+    xmg_driver_flush_pending(drv);
+    // Send queued asynchronous writes now, not while the EC is suspending
+    flush_delayed_work(&drv->async_work);
+    xmg_sampler_stop(drv);
+    drv->effect_suspended = READ_ONCE(drv->effect_running);
+    xmg_effect_stop(drv);
+    return 0;
+}
 
-    if(timeout) {
-        ret = xmg_driver_set_timeout(dev, timeout);
-        if(ret)
-            XMG_LOG_ERR(dev, "failed to set timeout after resume");
-    }
+// Function invoked after resume from suspend
+//  Set up keyboard state as it is lost after each suspend/power-off. This is
+//  done from work item, so resume doesn't wait for keyboard controller
+static int xmg_driver_resume(struct device *device) {
+    struct xmg_data *drv = dev_get_drvdata(device);
 
-    XMG_LOG_INFO(dev, "finished resume procedure");
+    drv->resume_time = ktime_get();
+    queue_work(drv->wq, &drv->restore_work);
+    xmg_sampler_start(drv);
     return 0;
 }
 
 static const struct dev_pm_ops xmg_driver_pm_ops = {
+    .suspend	= xmg_driver_suspend,
     .resume		= xmg_driver_resume,
 };
 
@@ -589,11 +3228,16 @@ static struct platform_driver xmg_driver = {
         .name = "xmg_driver",
         .acpi_match_table = ACPI_PTR(xmg_driver_acpi_match),
         .pm = &xmg_driver_pm_ops,
+        .dev_groups = xmg_driver_groups,
+        .probe_type = PROBE_PREFER_ASYNCHRONOUS,
     },
 };
 
 module_platform_driver(xmg_driver);
 
+#ifdef XMG_KUNIT_TEST
+    #include "xmg_kunit.c"
+#endif
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Pawel Wieczorek <contact@cerberos.pl>");
@@ -3,34 +3,282 @@
  *          in some XMG laptops
  */
 
+#include "xmg_uapi.h"
+#include "xmg_dchu.h"
+
 #define XMGDriverVersionStr	"1.9"
 
+/*
+ *	_DSM ARGUMENTS LAYOUT
+ */
+#define DSM_ARGS_COUNT              4
+#define DSM_PACKAGES_COUNT          0x104
+#define DSM_MIN_BUFFER_SIZE         0x10
+
+/*
+ *	FAN DATA RETURNED BY FAN_DCHU_COMMAND_GET
+ */
+// CPU, GPU and GPU2 - each with fan speed, duty and temperature
+#define XMG_HWMON_CHANNELS          3
+
+// Thermal zones for CPU and GPU temperature
+#define XMG_THERMAL_ZONES           2
+#define XMG_THERMAL_TRIPS           1
+#define XMG_THERMAL_CPU             0       // Zone which can throttle processors
+#define THERMAL_PASSIVE_TEMP        97000   // in millidegrees, just below TjMax
+#define THERMAL_HYSTERESIS          2000
+#define THERMAL_PASSIVE_DELAY       1000    // in milliseconds
+#define THERMAL_POLLING_DELAY       2000
+
+struct xmg_data;
+
+// Private data of each thermal zone
+struct xmg_thermal_priv {
+    struct xmg_data* xmg;
+    int channel;                        // XMG_HWMON_CHANNELS index
+};
+
+struct xmg_fan_acpi_response {
+    u8      reserved1[2];
+    u16     cpu_rpm;
+    u16     gpu_rpm;
+    u16     gpu2_rpm;
+    u8      reserved2[8];
+
+    u8      cpu_duty;
+    u8      reserved3[1];
+    u8      cpu_temp;
+    u8      gpu_duty;
+    u8      reserved4[1];
+    u8      gpu_temp;
+    u8      gpu2_duty;
+    u8      reserved5[1];
+    u8      gpu2_temp;
+} __packed;
+
+// Number of hotkey events kept for readers
+#define XMG_EVENT_RING_SIZE         64
+
+/*
+ *	_DSM STATISTICS
+ *  - latency histogram uses log2 buckets (bucket N counts calls which took
+ *    [2^N, 2^(N+1)) nanoseconds)
+ */
+#define XMG_STATS_COMMANDS          256     // Last slot aggregates other commands
+#define XMG_STATS_BUCKETS           32
+
+struct xmg_cmd_stats {
+    u64     calls;
+    u64     errors;
+    u64     total_ns;
+    u64     min_ns;
+    u64     max_ns;
+    u32     histogram[XMG_STATS_BUCKETS];
+};
+
 struct xmg_data {
     struct platform_device* pdev;
     struct miscdevice mdev;
     struct device *hdev;
+
+    // Released by remove - open files and io_uring commands whose
+    //  completion is still pending in the submitter's task hold additional
+    //  references
+    struct kref ref;
+
+    // Set by remove before anything is torn down - file operations hold
+    //  remove_lock for reading and fail with ENODEV once it is set
+    struct rw_semaphore remove_lock;
+    bool dead;
     
-    // Remembered state
-    atomic_t brightness;
-    atomic_t color;
-    atomic_t timeout;
+    // Remembered state - written under state_lock, read locklessly
+    //  through state_seq
+    struct mutex state_lock;
+    seqcount_mutex_t state_seq;
+    struct xmg_state_info state_info;
+
+    // Known hardware state - used to skip redundant writes (guarded by state_lock)
+    unsigned long hw_valid;             // XMG_STATE_* fields with known value
+    int hw_values[XMG_STATE_FIELDS_COUNT];
+    atomic_t skipped_writes;
+
+    // Restore of keyboard state after resume
+    struct work_struct restore_work;
+    ktime_t resume_time;
+    s64 resume_latency_us;
+
+    // Initial state from module parameters, applied after probe
+    struct work_struct init_work;
+    ktime_t probe_time;
+    s64 init_latency_us;
+
+    // Cached fan/temperature snapshot shared by all hwmon attributes - the
+    //  lock is not held while the snapshot is refreshed
+    struct mutex fan_lock;
+    struct xmg_fan_acpi_response fan_data;
+    bool fan_data_valid;
+    unsigned long fan_data_expires;     // in jiffies
+    unsigned int update_interval;       // in milliseconds
+
+    // Background sampler checking alarm limits (guarded by fan_lock)
+    struct delayed_work sampler_work;
+    bool sampler_stopped;
+    unsigned int sampler_interval;      // in milliseconds
+    int last_temp[XMG_HWMON_CHANNELS];
+    int temp_max[XMG_HWMON_CHANNELS];   // in millidegrees, 0 - not set
+    int temp_crit[XMG_HWMON_CHANNELS];  // in millidegrees, 0 - not set
+    int fan_min[XMG_HWMON_CHANNELS];    // in RPM, 0 - not set
+    unsigned long alarms;               // XMG_ALARM_BIT() bits
+
+    // Preallocated _DSM arguments - only command and input buffer
+    //  are patched on each call
+    struct mutex acpi_lock;
+    union acpi_object acpi_args[DSM_ARGS_COUNT];
+    union acpi_object* acpi_packages;
+    char acpi_small_buffer[DSM_MIN_BUFFER_SIZE];
+
+    // Per-command _DSM statistics (guarded by acpi_lock)
+    struct xmg_cmd_stats* acpi_stats;
+    struct dentry* debugfs;
+    atomic_t acpi_contended;            // _DSM calls which had to wait for acpi_lock
+
+    // Single-flight of FAN_DCHU_COMMAND_GET - concurrent readers share
+    //  result of the call in progress (guarded by fan_flight_lock)
+    spinlock_t fan_flight_lock;
+    wait_queue_head_t fan_flight_wq;
+    bool fan_inflight;
+    unsigned int fan_flight_gen;        // Incremented when call completes
+    int fan_flight_ret;
+    struct xmg_fan_acpi_response fan_flight_data;
+    atomic_t fan_shared;                // Reads served by another reader's call
+
+    // Errors reported with rate-limited logging
+    atomic_t hwmon_errors;
+    atomic_t fan_stalled;
+    atomic_t dchu_errors;
+
+    // Asynchronous command queue used after XMG_SET_ASYNC
+    //  - only the latest pending value of each field is kept
+    struct workqueue_struct* wq;
+    struct delayed_work async_work;
+    spinlock_t async_lock;
+    unsigned int async_pending;         // XMG_STATE_* mask
+    int async_values[XMG_STATE_FIELDS_COUNT];
+    unsigned long async_next_call;      // in jiffies
+    int async_error;
+    atomic_t async_coalesced;
+    atomic_t async_dropped;
+
+    // Keyboard writes in progress (synchronous or from the queue) - sensor
+    //  refreshes are not started meanwhile
+    atomic_t keyboard_writers;
+
+    // Hotkey events reported by firmware - kept in a ring, every opened
+    //  file reads it with its own cursor
+    spinlock_t event_lock;
+    wait_queue_head_t event_wq;
+    struct xmg_event events[XMG_EVENT_RING_SIZE];
+    u64 event_head;                     // Number of events ever queued
+
+    // io_uring passthrough - requests are executed by uring_wq (frozen
+    //  during suspend) and completed in context of the submitting task
+    struct workqueue_struct* uring_wq;
+
+    // Lighting effect engine - hrtimer ticks at configured frame rate
+    //  and queues effect_work which sends the frame to keyboard
+    struct mutex effect_lock;
+    struct hrtimer effect_timer;
+    struct work_struct effect_work;
+    struct xmg_effect_frame* effect_frames;
+    unsigned int effect_count;
+    unsigned int effect_flags;
+    unsigned int effect_length;         // in milliseconds
+    ktime_t effect_period;
+    ktime_t effect_start;
+    bool effect_running;
+    bool effect_suspended;
+    atomic_t effect_skipped;
+
+#if IS_REACHABLE(CONFIG_LEDS_CLASS_MULTICOLOR)
+    // Multicolor LED class device (kbd_backlight)
+    struct led_classdev_mc led;
+    struct mc_subled led_subleds[3];
+#endif
+
+#if IS_REACHABLE(CONFIG_THERMAL)
+    // Thermal zones of CPU and GPU temperatures - each with a passive trip
+    struct thermal_zone_device* tzd[XMG_THERMAL_ZONES];
+    struct thermal_trip thermal_trips[XMG_THERMAL_ZONES][XMG_THERMAL_TRIPS];
+    struct xmg_thermal_priv thermal_priv[XMG_THERMAL_ZONES];
+#endif
+
+    // IIO scans filled from the cached snapshot while keyboard writes
+    //  were pending
+    atomic_t iio_cached_scans;
+
+#if IS_REACHABLE(CONFIG_IIO_TRIGGERED_BUFFER)
+    // IIO device with buffered fan telemetry
+    struct iio_dev* iio;
+#endif
+};
+
+// Private data of every opened /dev/xmg_driver
+struct xmg_file {
+    struct xmg_data* xmg;
+    u64 event_cursor;                   // Next event to be read
+    bool async;                         // Queue set requests (XMG_SET_ASYNC)
 };
 
 
 /*
- *	MAGIC CODES USED BY _DSM
+ *	DRIVER LIMITS
  */
-#define KEYBOARD_DCHU_COMMAND       103
-#define KEYBOARD_DCHU_COMMAND_2     121
+#define MAX_BRIGHTNESS_LEVEL        XMG_MAX_BRIGHTNESS
 
-#define KEYBOARD_COLOR_MAGIC        0xF0
-#define KEYBOARD_BRIGHTNESS_MAGIC   0xF4
-#define KEYBOARD_TIMEOUT_MAGIC      0x18
-#define KEYBOARD_BOOT_MAGIC         0x18
+// Keyboard controller expects colors in BBRRGG format
+#define KEYBOARD_RGB_TO_COLOR(R, G, B)  (((B) & 0xff) << 16 | ((R) & 0xff) << 8 | ((G) & 0xff))
+// Convert between keyboard format (BBRRGG) and the usual RRGGBB one
+#define KEYBOARD_COLOR_FROM_HEX(X)      KEYBOARD_RGB_TO_COLOR((X) >> 16, (X) >> 8, (X))
+#define KEYBOARD_COLOR_TO_HEX(C)        (((C) & 0xff00) << 8 | ((C) & 0xff) << 8 | ((C) >> 16 & 0xff))
 
-#define MAX_BRIGHTNESS_LEVEL        191
+#define FAN_DEFAULT_UPDATE_INTERVAL 1000
+#define FAN_MAX_UPDATE_INTERVAL     60000
 
-#define FAN_DCHU_COMMAND_GET        12
+// Sampler runs faster when temperature changes by at least SAMPLER_TEMP_DELTA
+//  degrees between samples and slows down when it is stable
+#define SAMPLER_MIN_INTERVAL        250
+#define SAMPLER_MAX_INTERVAL        4000
+#define SAMPLER_TEMP_DELTA          2
+
+/*
+ *	IIO CHANNELS
+ *  - every scan is filled from a single FAN_DCHU_COMMAND_GET call
+ */
+enum xmg_iio_scan {
+    XMG_IIO_CPU_RPM,
+    XMG_IIO_GPU_RPM,
+    XMG_IIO_GPU2_RPM,
+    XMG_IIO_CPU_TEMP,
+    XMG_IIO_GPU_TEMP,
+    XMG_IIO_GPU2_TEMP,
+    XMG_IIO_TIMESTAMP,
+};
+
+struct xmg_iio_scan_data {
+    u32     rpm[XMG_HWMON_CHANNELS];
+    u8      temp[XMG_HWMON_CHANNELS];
+    s64     timestamp __aligned(8);
+};
+
+enum xmg_alarm {
+    XMG_ALARM_TEMP_MAX,
+    XMG_ALARM_TEMP_CRIT,
+    XMG_ALARM_FAN_MIN,
+
+    XMG_ALARMS_PER_CHANNEL
+};
+#define XMG_ALARM_BIT(CHANNEL, ALARM)   ((CHANNEL) * XMG_ALARMS_PER_CHANNEL + (ALARM))
+#define XMG_ALARMS_COUNT                (XMG_HWMON_CHANNELS * XMG_ALARMS_PER_CHANNEL)
 
 
 /*
@@ -40,6 +288,10 @@ struct xmg_data {
 #define XMG_LOG_WARN(DEV, FMT, ...)     dev_warn(DEV, "[%s] " FMT, __func__, ##__VA_ARGS__)
 #define XMG_LOG_ERR(DEV, FMT, ...)      dev_err(DEV, "[%s] " FMT, __func__, ##__VA_ARGS__)
 
+// Used on paths which can be triggered by polling userspace
+#define XMG_LOG_WARN_RL(DEV, FMT, ...)  dev_warn_ratelimited(DEV, "[%s] " FMT, __func__, ##__VA_ARGS__)
+#define XMG_LOG_ERR_RL(DEV, FMT, ...)   dev_err_ratelimited(DEV, "[%s] " FMT, __func__, ##__VA_ARGS__)
+
 /*
  *	ACPI HELPERS
  */
@@ -60,23 +312,3 @@ struct xmg_data {
                 (SRC).package.elements = (union acpi_object *)(PKGS);       \
                 (SRC).package.count = (CNT);                                \
                 } while(0)
-
-/*
- *	IOCTL STRUCTURES
- */
-struct xmg_dchu {
-    int             cmd;
-    char* __user    ubuf;
-    unsigned int    length;
-};
-
-
-/*
- *	IOCTL CODES
- */
-#define XMG_MAGIC_CODE      'X'
-#define XMG_SET_BRIGHTNESS  _IOW(XMG_MAGIC_CODE, 0x00, int)
-#define XMG_SET_COLOR       _IOW(XMG_MAGIC_CODE, 0x01, int)
-#define XMG_SET_TIMEOUT     _IOW(XMG_MAGIC_CODE, 0x02, int)
-#define XMG_SET_BOOT        _IOW(XMG_MAGIC_CODE, 0x03, int)
-#define XMG_CALL_DCHU       _IOWR(XMG_MAGIC_CODE, 0x10, struct xmg_dchu*)
@@ -0,0 +1,386 @@
+/*
+ *  xmg_kunit.c - KUnit suite of xmg_driver
+ *
+ *  Included at the end of xmg_driver.c when built with `make KUNIT=1`,
+ *  so static functions of the driver can be tested directly. _DSM
+ *  evaluation is replaced with a fake embedded controller, which records
+ *  the arguments and returns a response supplied by the test.
+ */
+#include <kunit/test.h>
+#include <kunit/static_stub.h>
+
+#define XMG_KUNIT_BENCH_CALLS       10000
+
+/*
+ * _DSM MOCK
+ */
+struct xmg_kunit_ctx {
+    struct platform_device pdev;
+    struct xmg_data xmg;
+
+    // Copy of arguments passed to the last evaluation
+    unsigned int calls;
+    unsigned int args_count;
+    union acpi_object args[DSM_ARGS_COUNT];
+    u8 uuid[sizeof(DCHU_UUID)];
+    u8 payload[DSM_MIN_BUFFER_SIZE];
+    u32 payload_length;
+    u32 package_count;
+
+    // Programmed response - ACPI_TYPE_INTEGER (0) or ACPI_TYPE_BUFFER
+    acpi_status status;
+    acpi_object_type response_type;
+    u8 response[DSM_MIN_BUFFER_SIZE * 2];
+    u32 response_length;
+};
+
+static acpi_status xmg_kunit_evaluate(acpi_handle handle, struct acpi_object_list* args,
+            struct acpi_buffer* output) {
+    struct kunit* test = kunit_get_current_test();
+    struct xmg_kunit_ctx* ctx = test->priv;
+    union acpi_object* package;
+    union acpi_object* result;
+
+    ctx->calls++;
+    ctx->args_count = args->count;
+    memcpy(ctx->args, args->pointer, min_t(u32, args->count, DSM_ARGS_COUNT) * sizeof(union acpi_object));
+
+    // Buffers are owned by the caller - copy them while they are valid
+    if(args->count == DSM_ARGS_COUNT) {
+        memcpy(ctx->uuid, args->pointer[0].buffer.pointer,
+            min_t(u32, args->pointer[0].buffer.length, sizeof(ctx->uuid)));
+
+        package = args->pointer[3].package.elements;
+        ctx->package_count = args->pointer[3].package.count;
+        ctx->payload_length = package[0].buffer.length;
+        memcpy(ctx->payload, package[0].buffer.pointer,
+            min_t(u32, package[0].buffer.length, sizeof(ctx->payload)));
+    }
+
+    if(ACPI_FAILURE(ctx->status))
+        return ctx->status;
+
+    // Mimic ACPI_ALLOCATE_BUFFER - object and its data in a single block,
+    //  caller frees the result with kfree()
+    result = kzalloc(sizeof(*result) + ctx->response_length, GFP_KERNEL);
+    if(!result)
+        return AE_NO_MEMORY;
+
+    result->type = ctx->response_type;
+    if(ctx->response_type == ACPI_TYPE_BUFFER) {
+        result->buffer.length = ctx->response_length;
+        result->buffer.pointer = (u8*)(result + 1);
+        memcpy(result->buffer.pointer, ctx->response, ctx->response_length);
+    }
+
+    output->pointer = result;
+    output->length = sizeof(*result) + ctx->response_length;
+    return AE_OK;
+}
+
+static void xmg_kunit_respond_buffer(struct xmg_kunit_ctx* ctx, const void* data, u32 length) {
+    ctx->response_type = ACPI_TYPE_BUFFER;
+    ctx->response_length = min_t(u32, length, sizeof(ctx->response));
+    memcpy(ctx->response, data, ctx->response_length);
+}
+
+// Response of FAN_DCHU_COMMAND_GET as firmware formats it - RPM fields are big-endian
+static void xmg_kunit_fan_response(u8* raw) {
+    memset(raw, 0, sizeof(struct xmg_fan_acpi_response));
+
+    raw[offsetof(struct xmg_fan_acpi_response, cpu_rpm)] = 0x01;
+    raw[offsetof(struct xmg_fan_acpi_response, cpu_rpm) + 1] = 0x2c;
+    // GPU fan is stopped - no pulses counted
+    raw[offsetof(struct xmg_fan_acpi_response, gpu2_rpm)] = 0x12;
+    raw[offsetof(struct xmg_fan_acpi_response, gpu2_rpm) + 1] = 0x34;
+
+    raw[offsetof(struct xmg_fan_acpi_response, cpu_duty)] = 128;
+    raw[offsetof(struct xmg_fan_acpi_response, cpu_temp)] = 55;
+    raw[offsetof(struct xmg_fan_acpi_response, gpu_temp)] = 40;
+    raw[offsetof(struct xmg_fan_acpi_response, gpu2_duty)] = 255;
+    raw[offsetof(struct xmg_fan_acpi_response, gpu2_temp)] = 70;
+}
+
+static int xmg_kunit_init(struct kunit* test) {
+    struct xmg_kunit_ctx* ctx;
+
+    ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, ctx);
+
+    ctx->xmg.pdev = &ctx->pdev;
+    dev_set_drvdata(&ctx->pdev.dev, &ctx->xmg);
+    KUNIT_ASSERT_EQ(test, xmg_acpi_arena_init(&ctx->xmg), 0);
+    mutex_init(&ctx->xmg.fan_lock);
+    ctx->xmg.update_interval = FAN_DEFAULT_UPDATE_INTERVAL;
+
+    ctx->status = AE_OK;
+    ctx->response_type = ACPI_TYPE_INTEGER;
+    test->priv = ctx;
+    kunit_activate_static_stub(test, xmg_acpi_evaluate, xmg_kunit_evaluate);
+    return 0;
+}
+
+static void xmg_kunit_exit(struct kunit* test) {
+    struct xmg_kunit_ctx* ctx = test->priv;
+
+    xmg_acpi_arena_free(&ctx->xmg);
+}
+
+static u32 xmg_kunit_payload_word(struct xmg_kunit_ctx* ctx) {
+    u32 value;
+
+    memcpy(&value, ctx->payload, sizeof(value));
+    return value;
+}
+
+/*
+ * ENCODERS
+ */
+static void xmg_kunit_encode_brightness(struct kunit* test) {
+    KUNIT_EXPECT_EQ(test, (u32)xmg_encode_brightness(0), 0xF4000000u);
+    KUNIT_EXPECT_EQ(test, (u32)xmg_encode_brightness(100), 0xF4000064u);
+    KUNIT_EXPECT_EQ(test, (u32)xmg_encode_brightness(XMG_MAX_BRIGHTNESS), 0xF40000BFu);
+}
+
+static void xmg_kunit_encode_color(struct kunit* test) {
+    KUNIT_EXPECT_EQ(test, (u32)xmg_encode_color(0), 0xF0000000u);
+    KUNIT_EXPECT_EQ(test, (u32)xmg_encode_color(0x123456), 0xF0123456u);
+    KUNIT_EXPECT_EQ(test, (u32)xmg_encode_color(KEYBOARD_COLOR_FROM_HEX(0xff8000)), 0xF000FF80u);
+}
+
+static void xmg_kunit_encode_timeout(struct kunit* test) {
+    KUNIT_EXPECT_EQ(test, (u32)xmg_encode_timeout(-1), 0x18000000u);
+    KUNIT_EXPECT_EQ(test, (u32)xmg_encode_timeout(0), 0x180000FFu);
+    KUNIT_EXPECT_EQ(test, (u32)xmg_encode_timeout(300), 0x18012CFFu);
+    KUNIT_EXPECT_EQ(test, (u32)xmg_encode_timeout(XMG_MAX_TIMEOUT), 0x18FFFFFFu);
+}
+
+static void xmg_kunit_encode_boot(struct kunit* test) {
+    KUNIT_EXPECT_EQ(test, (u32)xmg_encode_boot(0), 0x18000000u);
+    KUNIT_EXPECT_EQ(test, (u32)xmg_encode_boot(1), 0x18000001u);
+    KUNIT_EXPECT_EQ(test, (u32)xmg_encode_boot(5), 0x18000001u);
+}
+
+/*
+ * _DSM ARGUMENTS
+ */
+static void xmg_kunit_dsm_layout(struct kunit* test) {
+    struct xmg_kunit_ctx* ctx = test->priv;
+    struct acpi_buffer output = {0};
+    int encoded = xmg_encode_brightness(100);
+    int i;
+
+    mutex_lock(&ctx->xmg.acpi_lock);
+    KUNIT_EXPECT_EQ(test, xmg_acpi_call_locked(&ctx->pdev.dev, KEYBOARD_DCHU_COMMAND,
+                (char*)&encoded, sizeof(encoded), &output), 0);
+    mutex_unlock(&ctx->xmg.acpi_lock);
+
+    KUNIT_ASSERT_EQ(test, ctx->calls, 1u);
+    KUNIT_ASSERT_EQ(test, ctx->args_count, (unsigned int)DSM_ARGS_COUNT);
+
+    // UUID, revision, function and package with the payload
+    KUNIT_EXPECT_EQ(test, ctx->args[0].type, (u32)ACPI_TYPE_BUFFER);
+    KUNIT_EXPECT_EQ(test, ctx->args[0].buffer.length, (u32)sizeof(DCHU_UUID));
+    KUNIT_EXPECT_MEMEQ(test, ctx->uuid, DCHU_UUID, sizeof(DCHU_UUID));
+    KUNIT_EXPECT_EQ(test, ctx->args[1].type, (u32)ACPI_TYPE_INTEGER);
+    KUNIT_EXPECT_EQ(test, ctx->args[1].integer.value, 0ull);
+    KUNIT_EXPECT_EQ(test, ctx->args[2].type, (u32)ACPI_TYPE_INTEGER);
+    KUNIT_EXPECT_EQ(test, ctx->args[2].integer.value, (u64)KEYBOARD_DCHU_COMMAND);
+    KUNIT_EXPECT_EQ(test, ctx->args[3].type, (u32)ACPI_TYPE_PACKAGE);
+    KUNIT_EXPECT_EQ(test, ctx->package_count, (u32)DSM_PACKAGES_COUNT);
+
+    // Short payload is padded with zeros to DSM_MIN_BUFFER_SIZE
+    KUNIT_EXPECT_EQ(test, ctx->payload_length, (u32)DSM_MIN_BUFFER_SIZE);
+    KUNIT_EXPECT_EQ(test, xmg_kunit_payload_word(ctx), (u32)encoded);
+    for(i = sizeof(encoded); i < DSM_MIN_BUFFER_SIZE; i++)
+        KUNIT_EXPECT_EQ(test, ctx->payload[i], 0);
+
+    // Result of the evaluation is handed over to the caller
+    KUNIT_ASSERT_NOT_NULL(test, output.pointer);
+    KUNIT_EXPECT_EQ(test, ((union acpi_object*)output.pointer)->type, (u32)ACPI_TYPE_INTEGER);
+    kfree(output.pointer);
+
+    KUNIT_EXPECT_EQ(test, ctx->xmg.acpi_stats[KEYBOARD_DCHU_COMMAND].calls, 1ull);
+    KUNIT_EXPECT_EQ(test, ctx->xmg.acpi_stats[KEYBOARD_DCHU_COMMAND].errors, 0ull);
+}
+
+static void xmg_kunit_dsm_failure(struct kunit* test) {
+    struct xmg_kunit_ctx* ctx = test->priv;
+    int encoded = xmg_encode_color(0x123456);
+
+    ctx->status = AE_ERROR;
+    KUNIT_EXPECT_EQ(test, xmg_acpi_call(&ctx->pdev.dev, KEYBOARD_DCHU_COMMAND,
+                (char*)&encoded, sizeof(encoded), NULL), -EFAULT);
+    KUNIT_EXPECT_EQ(test, ctx->xmg.acpi_stats[KEYBOARD_DCHU_COMMAND].errors, 1ull);
+}
+
+// Every field goes through its encoder and the matching DCHU command
+static void xmg_kunit_write_fields(struct kunit* test) {
+    static const struct {
+        enum xmg_state_field field;
+        int value;
+        int cmd;
+        u32 payload;
+    } cases[] = {
+        { XMG_STATE_FIELD_BRIGHTNESS,   191,        KEYBOARD_DCHU_COMMAND,      0xF40000BF },
+        { XMG_STATE_FIELD_COLOR,        0x00ff80,   KEYBOARD_DCHU_COMMAND,      0xF000FF80 },
+        { XMG_STATE_FIELD_TIMEOUT,      300,        KEYBOARD_DCHU_COMMAND_2,    0x18012CFF },
+        { XMG_STATE_FIELD_BOOT,         1,          KEYBOARD_DCHU_COMMAND_2,    0x18000001 },
+    };
+    struct xmg_kunit_ctx* ctx = test->priv;
+    int i;
+
+    for(i = 0; i < ARRAY_SIZE(cases); i++) {
+        ctx->calls = 0;
+        KUNIT_EXPECT_EQ(test, xmg_driver_write_field(&ctx->xmg, cases[i].field, cases[i].value), 0);
+        KUNIT_EXPECT_EQ(test, ctx->calls, 1u);
+        KUNIT_EXPECT_EQ(test, ctx->args[2].integer.value, (u64)cases[i].cmd);
+        KUNIT_EXPECT_EQ(test, xmg_kunit_payload_word(ctx), cases[i].payload);
+    }
+
+    // Invalid values never reach the firmware
+    ctx->calls = 0;
+    KUNIT_EXPECT_EQ(test, xmg_driver_write_field(&ctx->xmg, XMG_STATE_FIELD_BRIGHTNESS,
+                XMG_MAX_BRIGHTNESS + 1), -EINVAL);
+    KUNIT_EXPECT_EQ(test, xmg_driver_write_field(&ctx->xmg, XMG_STATE_FIELD_COLOR, 0x1000000), -EINVAL);
+    KUNIT_EXPECT_EQ(test, ctx->calls, 0u);
+}
+
+/*
+ * SENSOR PATH
+ */
+static void xmg_kunit_fan_decode(struct kunit* test) {
+    struct xmg_kunit_ctx* ctx = test->priv;
+    struct xmg_fan_acpi_response fan_data;
+    struct xmg_fan_channel values;
+    u8 raw[sizeof(struct xmg_fan_acpi_response)];
+
+    xmg_kunit_fan_response(raw);
+    xmg_kunit_respond_buffer(ctx, raw, sizeof(raw));
+
+    KUNIT_ASSERT_EQ(test, xmg_fan_get_data(&ctx->pdev.dev, &fan_data), 0);
+    KUNIT_EXPECT_EQ(test, ctx->calls, 1u);
+    KUNIT_EXPECT_EQ(test, ctx->args[2].integer.value, (u64)FAN_DCHU_COMMAND_GET);
+
+    // RPM fields are converted to CPU byte order, the rest is copied as is
+    KUNIT_EXPECT_EQ(test, fan_data.cpu_rpm, 0x012c);
+    KUNIT_EXPECT_EQ(test, fan_data.gpu_rpm, 0);
+    KUNIT_EXPECT_EQ(test, fan_data.gpu2_rpm, 0x1234);
+    KUNIT_EXPECT_EQ(test, fan_data.cpu_duty, 128);
+    KUNIT_EXPECT_EQ(test, fan_data.cpu_temp, 55);
+    KUNIT_EXPECT_EQ(test, fan_data.gpu2_duty, 255);
+    KUNIT_EXPECT_EQ(test, fan_data.gpu2_temp, 70);
+
+    KUNIT_EXPECT_EQ(test, xmg_fan_rpm(fan_data.cpu_rpm), 2156250u / 0x012c);
+    KUNIT_EXPECT_EQ(test, xmg_fan_rpm(fan_data.gpu2_rpm), 2156250u / 0x1234);
+
+    // Stopped fan is 0 RPM, but the channel still has data
+    xmg_fan_channel(&fan_data, 1, &values);
+    KUNIT_EXPECT_EQ(test, xmg_fan_rpm(values.rpm), 0u);
+    KUNIT_EXPECT_TRUE(test, xmg_fan_channel_has_data(&values));
+
+    // All zeros - channel not wired or GPU powered down
+    memset(&fan_data, 0, sizeof(fan_data));
+    xmg_fan_channel(&fan_data, 2, &values);
+    KUNIT_EXPECT_FALSE(test, xmg_fan_channel_has_data(&values));
+}
+
+static void xmg_kunit_fan_bad_response(struct kunit* test) {
+    struct xmg_kunit_ctx* ctx = test->priv;
+    struct xmg_fan_acpi_response fan_data;
+    u8 raw[sizeof(struct xmg_fan_acpi_response)];
+
+    // Integer instead of buffer
+    KUNIT_EXPECT_EQ(test, xmg_fan_get_data(&ctx->pdev.dev, &fan_data), -EFAULT);
+
+    // Buffer shorter than the response
+    xmg_kunit_fan_response(raw);
+    xmg_kunit_respond_buffer(ctx, raw, sizeof(raw) - 1);
+    KUNIT_EXPECT_EQ(test, xmg_fan_get_data(&ctx->pdev.dev, &fan_data), -EFAULT);
+
+    xmg_kunit_respond_buffer(ctx, raw, 0);
+    KUNIT_EXPECT_EQ(test, xmg_fan_get_data(&ctx->pdev.dev, &fan_data), -EFAULT);
+
+    // Failed evaluation
+    ctx->status = AE_ERROR;
+    KUNIT_EXPECT_EQ(test, xmg_fan_get_data(&ctx->pdev.dev, &fan_data), -EFAULT);
+
+    // Cache is not populated by failed reads
+    KUNIT_EXPECT_NE(test, xmg_fan_get_cached(&ctx->xmg, &fan_data), 0);
+    KUNIT_EXPECT_FALSE(test, ctx->xmg.fan_data_valid);
+}
+
+/*
+ * PER-CALL COST
+ *  - argument packaging, decoding and accounting, without the firmware
+ */
+static void xmg_kunit_dsm_cost(struct kunit* test) {
+    struct xmg_kunit_ctx* ctx = test->priv;
+    int encoded = xmg_encode_brightness(100);
+    u64 start, elapsed;
+    int i;
+
+    start = ktime_get_ns();
+    for(i = 0; i < XMG_KUNIT_BENCH_CALLS; i++)
+        xmg_acpi_call(&ctx->pdev.dev, KEYBOARD_DCHU_COMMAND, (char*)&encoded, sizeof(encoded), NULL);
+    elapsed = ktime_get_ns() - start;
+
+    KUNIT_EXPECT_EQ(test, ctx->calls, (unsigned int)XMG_KUNIT_BENCH_CALLS);
+    kunit_info(test, "xmg_acpi_call: %llu ns per call (%d calls)",
+        div_u64(elapsed, XMG_KUNIT_BENCH_CALLS), XMG_KUNIT_BENCH_CALLS);
+}
+
+static void xmg_kunit_sensor_cost(struct kunit* test) {
+    struct xmg_kunit_ctx* ctx = test->priv;
+    struct xmg_fan_acpi_response fan_data;
+    u8 raw[sizeof(struct xmg_fan_acpi_response)];
+    u64 start, elapsed;
+    int i;
+
+    xmg_kunit_fan_response(raw);
+    xmg_kunit_respond_buffer(ctx, raw, sizeof(raw));
+
+    // Every read evaluates _DSM and decodes the response
+    start = ktime_get_ns();
+    for(i = 0; i < XMG_KUNIT_BENCH_CALLS; i++)
+        xmg_fan_get_data(&ctx->pdev.dev, &fan_data);
+    elapsed = ktime_get_ns() - start;
+
+    KUNIT_EXPECT_EQ(test, ctx->calls, (unsigned int)XMG_KUNIT_BENCH_CALLS);
+    kunit_info(test, "xmg_fan_get_data: %llu ns per call (%d calls)",
+        div_u64(elapsed, XMG_KUNIT_BENCH_CALLS), XMG_KUNIT_BENCH_CALLS);
+
+    // Reads within update_interval are served from the snapshot
+    ctx->calls = 0;
+    start = ktime_get_ns();
+    for(i = 0; i < XMG_KUNIT_BENCH_CALLS; i++)
+        xmg_fan_get_cached(&ctx->xmg, &fan_data);
+    elapsed = ktime_get_ns() - start;
+
+    KUNIT_EXPECT_LE(test, ctx->calls, 1u + div_u64(elapsed, FAN_DEFAULT_UPDATE_INTERVAL * NSEC_PER_MSEC));
+    kunit_info(test, "xmg_fan_get_cached: %llu ns per call (%d calls, %u _DSM calls)",
+        div_u64(elapsed, XMG_KUNIT_BENCH_CALLS), XMG_KUNIT_BENCH_CALLS, ctx->calls);
+}
+
+static struct kunit_case xmg_kunit_cases[] = {
+    KUNIT_CASE(xmg_kunit_encode_brightness),
+    KUNIT_CASE(xmg_kunit_encode_color),
+    KUNIT_CASE(xmg_kunit_encode_timeout),
+    KUNIT_CASE(xmg_kunit_encode_boot),
+    KUNIT_CASE(xmg_kunit_dsm_layout),
+    KUNIT_CASE(xmg_kunit_dsm_failure),
+    KUNIT_CASE(xmg_kunit_write_fields),
+    KUNIT_CASE(xmg_kunit_fan_decode),
+    KUNIT_CASE(xmg_kunit_fan_bad_response),
+    KUNIT_CASE(xmg_kunit_dsm_cost),
+    KUNIT_CASE(xmg_kunit_sensor_cost),
+    {}
+};
+
+static struct kunit_suite xmg_kunit_suite = {
+    .name = "xmg_driver",
+    .init = xmg_kunit_init,
+    .exit = xmg_kunit_exit,
+    .test_cases = xmg_kunit_cases,
+};
+kunit_test_suite(xmg_kunit_suite);
@@ -0,0 +1,55 @@
+/*  
+ *  xmg_trace.h - Tracepoints of xmg_driver
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM xmg_driver
+
+#if !defined(_XMG_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _XMG_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(xmg_acpi_call_enter,
+    TP_PROTO(int cmd, size_t length),
+    TP_ARGS(cmd, length),
+
+    TP_STRUCT__entry(
+        __field(int,        cmd)
+        __field(size_t,     length)
+    ),
+
+    TP_fast_assign(
+        __entry->cmd = cmd;
+        __entry->length = length;
+    ),
+
+    TP_printk("cmd=%d length=%zu", __entry->cmd, __entry->length)
+);
+
+TRACE_EVENT(xmg_acpi_call_exit,
+    TP_PROTO(int cmd, u32 status, u64 latency_ns),
+    TP_ARGS(cmd, status, latency_ns),
+
+    TP_STRUCT__entry(
+        __field(int,        cmd)
+        __field(u32,        status)
+        __field(u64,        latency_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->cmd = cmd;
+        __entry->status = status;
+        __entry->latency_ns = latency_ns;
+    ),
+
+    TP_printk("cmd=%d status=0x%x latency_ns=%llu",
+        __entry->cmd, __entry->status, __entry->latency_ns)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE xmg_trace
+#include <trace/define_trace.h>
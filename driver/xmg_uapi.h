@@ -0,0 +1,172 @@
+/*  
+ *  xmg_uapi.h - Interface of xmg_driver shared by the kernel
+ *          module and userspace tools
+ */
+#ifndef XMG_UAPI_H
+#define XMG_UAPI_H
+
+#ifdef __KERNEL__
+    #include <linux/ioctl.h>
+#else
+    #include <sys/ioctl.h>
+
+    #ifndef __user
+        #define __user
+    #endif
+#endif
+
+#define XMG_DEVICE_PATH     "/dev/xmg_driver"
+
+#define XMG_MAX_BRIGHTNESS  191
+#define XMG_MAX_TIMEOUT     0xffff
+#define XMG_MAX_DCHU_LENGTH 4096
+#define XMG_MAX_DCHU_BATCH  256
+
+/*
+ *	IOCTL STRUCTURES
+ */
+struct xmg_dchu {
+    int             cmd;
+    char* __user    ubuf;
+    unsigned int    length;
+};
+
+/*
+ * Single command of XMG_CALL_DCHU_BATCH - input and output buffers are
+ *  separate, so output size doesn't dictate size of the input
+ */
+struct xmg_dchu_entry {
+    int                 cmd;
+    unsigned int        in_length;
+    const char* __user  in_buf;
+    char* __user        out_buf;
+    unsigned int        out_capacity;
+    unsigned int        out_length;     // out: size of saved output
+    int                 status;         // out: 0 or negative errno
+};
+
+// Don't execute remaining entries after the first failure
+#define XMG_DCHU_BATCH_STOP_ON_ERROR    (1u << 0)
+
+struct xmg_dchu_batch {
+    unsigned int                    count;
+    unsigned int                    flags;
+    struct xmg_dchu_entry* __user   entries;
+    unsigned int                    completed;  // out: number of executed entries
+};
+
+enum xmg_state_field {
+    XMG_STATE_FIELD_BRIGHTNESS,
+    XMG_STATE_FIELD_COLOR,
+    XMG_STATE_FIELD_TIMEOUT,
+    XMG_STATE_FIELD_BOOT,
+
+    XMG_STATE_FIELDS_COUNT
+};
+
+#define XMG_STATE_BRIGHTNESS    (1 << XMG_STATE_FIELD_BRIGHTNESS)
+#define XMG_STATE_COLOR         (1 << XMG_STATE_FIELD_COLOR)
+#define XMG_STATE_TIMEOUT       (1 << XMG_STATE_FIELD_TIMEOUT)
+#define XMG_STATE_BOOT          (1 << XMG_STATE_FIELD_BOOT)
+#define XMG_STATE_ALL           ((1 << XMG_STATE_FIELDS_COUNT) - 1)
+
+// Write fields even if keyboard is known to hold requested values already
+#define XMG_STATE_FORCE         (1u << 31)
+
+struct xmg_state {
+    unsigned int    mask;           // XMG_STATE_* fields to apply
+    int             brightness;
+    int             color;
+    int             timeout;
+    int             boot;
+    int             result[XMG_STATE_FIELDS_COUNT];     // Per-field status (0 or -errno)
+};
+
+// Snapshot of settings remembered by the driver
+struct xmg_state_info {
+    unsigned int    mask;           // XMG_STATE_* fields set since driver load and
+                                    //  not changed by firmware hotkeys since then
+    int             brightness;
+    int             color;
+    int             timeout;
+    int             boot;           // 1 - boot effect was overwritten
+    unsigned int    generation;     // Incremented on every change of the state
+};
+
+enum xmg_effect_easing {
+    XMG_EASING_STEP,            // Hold frame until the next one
+    XMG_EASING_LINEAR,
+    XMG_EASING_IN_OUT,          // Smoothstep
+
+    XMG_EASING_COUNT
+};
+
+#define XMG_EFFECT_LOOP         (1 << 0)
+
+#define XMG_EFFECT_MAX_FRAMES   64
+#define XMG_EFFECT_DEFAULT_FPS  30
+#define XMG_EFFECT_MAX_FPS      100
+
+struct xmg_effect_frame {
+    int             color;          // BBRRGG
+    int             brightness;
+    unsigned int    duration;       // Time of transition to the next frame (ms)
+    unsigned int    easing;         // enum xmg_effect_easing
+};
+
+struct xmg_effect {
+    unsigned int    count;          // Number of frames - 0 stops running effect
+    unsigned int    fps;            // 0 - use default
+    unsigned int    flags;          // XMG_EFFECT_*
+    struct xmg_effect_frame* __user frames;
+};
+
+/*
+ * Keyboard hotkey event read() from the device - every opened file has its
+ *  own cursor, so readers don't consume events of each other
+ */
+enum xmg_event_type {
+    XMG_EVENT_BRIGHTNESS_DOWN,
+    XMG_EVENT_BRIGHTNESS_UP,
+    XMG_EVENT_CYCLE_COLOR,
+    XMG_EVENT_CYCLE_BRIGHTNESS,
+    XMG_EVENT_TOGGLE,
+};
+
+// Reader was too slow and older events were overwritten
+#define XMG_EVENT_LOST          (1u << 0)
+
+struct xmg_event {
+    unsigned int        type;           // enum xmg_event_type
+    unsigned int        code;           // Raw code reported by firmware
+    unsigned int        flags;          // XMG_EVENT_*
+    unsigned int        generation;     // Generation of state after the event
+    unsigned long long  timestamp_ns;   // CLOCK_MONOTONIC
+};
+
+/*
+ * Command area of IORING_OP_URING_CMD submission - cmd_op is one of
+ *  XMG_SET_{BRIGHTNESS,COLOR,TIMEOUT,BOOT,STATE} or XMG_CALL_DCHU and
+ *  arg carries the same value as the argument of ioctl()
+ */
+struct xmg_uring_cmd {
+    unsigned long long arg;
+};
+
+
+/*
+ *	IOCTL CODES
+ */
+#define XMG_MAGIC_CODE      'X'
+#define XMG_SET_BRIGHTNESS  _IOW(XMG_MAGIC_CODE, 0x00, int)
+#define XMG_SET_COLOR       _IOW(XMG_MAGIC_CODE, 0x01, int)
+#define XMG_SET_TIMEOUT     _IOW(XMG_MAGIC_CODE, 0x02, int)
+#define XMG_SET_BOOT        _IOW(XMG_MAGIC_CODE, 0x03, int)
+#define XMG_SET_STATE       _IOWR(XMG_MAGIC_CODE, 0x04, struct xmg_state)
+#define XMG_SET_EFFECT      _IOW(XMG_MAGIC_CODE, 0x05, struct xmg_effect)
+#define XMG_GET_STATE       _IOR(XMG_MAGIC_CODE, 0x06, struct xmg_state_info)
+#define XMG_SET_ASYNC       _IOW(XMG_MAGIC_CODE, 0x07, int)
+#define XMG_CALL_DCHU       _IOWR(XMG_MAGIC_CODE, 0x10, struct xmg_dchu*)
+#define XMG_CALL_DCHU_BATCH _IOWR(XMG_MAGIC_CODE, 0x11, struct xmg_dchu_batch)
+
+#endif
@@ -0,0 +1,387 @@
+/*
+ *  libxmg.c - Userspace library for interacting with xmg_driver
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xmg.h"
+#include "xmg_dchu.h"
+
+
+struct xmg_handle {
+    const struct xmg_backend_ops* ops;
+    void* ctx;
+};
+
+static int xmg_call(struct xmg_handle* handle, unsigned long cmd, unsigned long arg) {
+    int ret = handle->ops->call(handle->ctx, cmd, arg);
+    if(ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    return 0;
+}
+
+int xmg_open_backend(struct xmg_handle** handle, const struct xmg_backend_ops* ops, void* ctx) {
+    struct xmg_handle* h = malloc(sizeof(*h));
+    if(!h)
+        return -1;
+
+    h->ops = ops;
+    h->ctx = ctx;
+    *handle = h;
+    return 0;
+}
+
+void xmg_close(struct xmg_handle* handle) {
+    if(!handle)
+        return;
+
+    if(handle->ops->close)
+        handle->ops->close(handle->ctx);
+    free(handle);
+}
+
+/*
+ *	DEVICE BACKEND
+ */
+static int xmg_device_call(void* ctx, unsigned long cmd, unsigned long arg) {
+    int fd = (int)(intptr_t)ctx;
+
+    if(ioctl(fd, cmd, arg) < 0)
+        return -errno;
+    return 0;
+}
+
+static void xmg_device_close(void* ctx) {
+    close((int)(intptr_t)ctx);
+}
+
+static const struct xmg_backend_ops xmg_device_ops = {
+    .call = xmg_device_call,
+    .close = xmg_device_close,
+};
+
+int xmg_open(struct xmg_handle** handle, const char* path) {
+    int fd = open(path ? path : XMG_DEVICE_PATH, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return -1;
+
+    if(xmg_open_backend(handle, &xmg_device_ops, (void*)(intptr_t)fd)) {
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ *	FAKE BACKEND
+ *  - mimics validation and state tracking of the kernel driver
+ */
+static const struct xmg_backend_ops xmg_fake_ops;
+
+struct xmg_fake {
+    unsigned int latency_us;
+    struct xmg_state_info state;
+
+    // Last packet which would be sent to keyboard controller
+    unsigned long calls;
+    int last_cmd;
+    int last_payload;
+};
+
+static void xmg_fake_send(struct xmg_fake* fake, int cmd, int payload) {
+    struct timespec ts = {
+        .tv_sec = fake->latency_us / 1000000,
+        .tv_nsec = (fake->latency_us % 1000000) * 1000,
+    };
+
+    if(fake->latency_us)
+        nanosleep(&ts, NULL);
+
+    fake->calls++;
+    fake->last_cmd = cmd;
+    fake->last_payload = payload;
+}
+
+static int xmg_fake_check_state(struct xmg_state* state) {
+    if(state->mask & ~(XMG_STATE_ALL | XMG_STATE_FORCE))
+        return -EINVAL;
+
+    if(state->mask & XMG_STATE_BRIGHTNESS &&
+            (state->brightness < 0 || state->brightness > XMG_MAX_BRIGHTNESS))
+        state->result[XMG_STATE_FIELD_BRIGHTNESS] = -EINVAL;
+    if(state->mask & XMG_STATE_COLOR && state->color & 0xff000000)
+        state->result[XMG_STATE_FIELD_COLOR] = -EINVAL;
+    if(state->mask & XMG_STATE_TIMEOUT && state->timeout > XMG_MAX_TIMEOUT)
+        state->result[XMG_STATE_FIELD_TIMEOUT] = -EINVAL;
+
+    for(int i = 0; i < XMG_STATE_FIELDS_COUNT; i++)
+        if(state->result[i])
+            return -EINVAL;
+    return 0;
+}
+
+static int xmg_fake_set_state(struct xmg_fake* fake, struct xmg_state* state) {
+    int ret;
+
+    memset(state->result, 0, sizeof(state->result));
+    ret = xmg_fake_check_state(state);
+    if(ret)
+        return ret;
+
+    if(state->mask & XMG_STATE_BRIGHTNESS) {
+        xmg_fake_send(fake, KEYBOARD_DCHU_COMMAND, xmg_encode_brightness(state->brightness));
+        fake->state.brightness = state->brightness;
+    }
+    if(state->mask & XMG_STATE_COLOR) {
+        xmg_fake_send(fake, KEYBOARD_DCHU_COMMAND, xmg_encode_color(state->color));
+        fake->state.color = state->color;
+    }
+    if(state->mask & XMG_STATE_TIMEOUT) {
+        xmg_fake_send(fake, KEYBOARD_DCHU_COMMAND_2, xmg_encode_timeout(state->timeout));
+        fake->state.timeout = state->timeout;
+    }
+    if(state->mask & XMG_STATE_BOOT) {
+        xmg_fake_send(fake, KEYBOARD_DCHU_COMMAND_2, xmg_encode_boot(state->boot));
+        fake->state.boot = !!state->boot;
+    }
+
+    if(state->mask & XMG_STATE_ALL) {
+        fake->state.mask |= state->mask & XMG_STATE_ALL;
+        fake->state.generation++;
+    }
+    return 0;
+}
+
+/*
+ * Fake controller answers FAN_DCHU_COMMAND_GET with constant readings
+ *  (layout of struct xmg_fan_acpi_response, RPM in big endian) and
+ *  every other command with zeros
+ */
+static int xmg_fake_dchu_response(int cmd, char* buffer, unsigned int* length) {
+    static const unsigned char FAN_RESPONSE[] = {
+        0x00, 0x00,                     // reserved
+        0x05, 0x3d,                     // cpu_rpm  (~1600 RPM)
+        0x06, 0x20,                     // gpu_rpm  (~1350 RPM)
+        0x00, 0x00,                     // gpu2_rpm
+        0, 0, 0, 0, 0, 0, 0, 0,         // reserved
+        0x50, 0x00, 45,                 // cpu_duty, reserved, cpu_temp
+        0x40, 0x00, 40,                 // gpu_duty, reserved, gpu_temp
+        0x00, 0x00, 0,                  // gpu2_duty, reserved, gpu2_temp
+    };
+
+    if(cmd == FAN_DCHU_COMMAND_GET) {
+        if(*length < sizeof(FAN_RESPONSE)) {
+            memcpy(buffer, FAN_RESPONSE, *length);
+            return -E2BIG;
+        }
+        memcpy(buffer, FAN_RESPONSE, sizeof(FAN_RESPONSE));
+        *length = sizeof(FAN_RESPONSE);
+    } else
+        memset(buffer, 0, *length);
+
+    return 0;
+}
+
+static int xmg_fake_call_dchu(struct xmg_fake* fake, int cmd, const char* in, unsigned int in_length,
+                              char* out, unsigned int* out_length) {
+    int payload = 0;
+
+    memcpy(&payload, in, in_length < sizeof(payload) ? in_length : sizeof(payload));
+    xmg_fake_send(fake, cmd, payload);
+    return xmg_fake_dchu_response(cmd, out, out_length);
+}
+
+static int xmg_fake_call_dchu_batch(struct xmg_fake* fake, struct xmg_dchu_batch* batch) {
+    struct xmg_dchu_entry* entry;
+
+    batch->completed = 0;
+    if(!batch->count || batch->count > XMG_MAX_DCHU_BATCH ||
+            batch->flags & ~XMG_DCHU_BATCH_STOP_ON_ERROR)
+        return -EINVAL;
+
+    for(unsigned int i = 0; i < batch->count; i++) {
+        entry = &batch->entries[i];
+        batch->completed++;
+
+        entry->out_length = 0;
+        if(entry->in_length > XMG_MAX_DCHU_LENGTH || entry->out_capacity > XMG_MAX_DCHU_LENGTH)
+            entry->status = -EINVAL;
+        else {
+            entry->out_length = entry->out_capacity;
+            entry->status = xmg_fake_call_dchu(fake, entry->cmd, entry->in_buf, entry->in_length,
+                                               entry->out_buf, &entry->out_length);
+        }
+
+        if(entry->status && batch->flags & XMG_DCHU_BATCH_STOP_ON_ERROR)
+            return entry->status;
+    }
+    return 0;
+}
+
+int xmg_fake_last_call(struct xmg_handle* handle, int* cmd, int* payload, unsigned long* calls) {
+    struct xmg_fake* fake = handle->ctx;
+
+    if(handle->ops != &xmg_fake_ops) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *cmd = fake->last_cmd;
+    *payload = fake->last_payload;
+    *calls = fake->calls;
+    return 0;
+}
+
+static int xmg_fake_call(void* ctx, unsigned long cmd, unsigned long arg) {
+    struct xmg_fake* fake = ctx;
+    struct xmg_state state = {0};
+    struct xmg_effect* effect;
+    struct xmg_dchu* dchu;
+
+    switch(cmd) {
+        case XMG_SET_BRIGHTNESS:
+            state.mask = XMG_STATE_BRIGHTNESS;
+            state.brightness = (int)arg;
+            return xmg_fake_set_state(fake, &state);
+
+        case XMG_SET_COLOR:
+            state.mask = XMG_STATE_COLOR;
+            state.color = (int)arg;
+            return xmg_fake_set_state(fake, &state);
+
+        case XMG_SET_TIMEOUT:
+            state.mask = XMG_STATE_TIMEOUT;
+            state.timeout = (int)arg;
+            return xmg_fake_set_state(fake, &state);
+
+        case XMG_SET_BOOT:
+            state.mask = XMG_STATE_BOOT;
+            state.boot = (int)arg;
+            return xmg_fake_set_state(fake, &state);
+
+        case XMG_SET_STATE:
+            return xmg_fake_set_state(fake, (struct xmg_state*)arg);
+
+        case XMG_GET_STATE:
+            *(struct xmg_state_info*)arg = fake->state;
+            return 0;
+
+        // Fake device applies everything immediately
+        case XMG_SET_ASYNC:
+            return 0;
+
+        case XMG_SET_EFFECT:
+            effect = (struct xmg_effect*)arg;
+            if(effect->count > XMG_EFFECT_MAX_FRAMES || effect->fps > XMG_EFFECT_MAX_FPS)
+                return -EINVAL;
+            return 0;
+
+        case XMG_CALL_DCHU:
+            dchu = (struct xmg_dchu*)arg;
+            if(!dchu->length || dchu->length > XMG_MAX_DCHU_LENGTH)
+                return -EINVAL;
+
+            return xmg_fake_call_dchu(fake, dchu->cmd, dchu->ubuf, dchu->length,
+                                      dchu->ubuf, &dchu->length);
+
+        case XMG_CALL_DCHU_BATCH:
+            return xmg_fake_call_dchu_batch(fake, (struct xmg_dchu_batch*)arg);
+
+        default:
+            return -ENOTSUP;
+    }
+}
+
+static void xmg_fake_close(void* ctx) {
+    free(ctx);
+}
+
+static const struct xmg_backend_ops xmg_fake_ops = {
+    .call = xmg_fake_call,
+    .close = xmg_fake_close,
+};
+
+int xmg_open_fake(struct xmg_handle** handle, unsigned int latency_us) {
+    struct xmg_fake* fake = calloc(1, sizeof(*fake));
+    if(!fake)
+        return -1;
+
+    fake->latency_us = latency_us;
+    if(xmg_open_backend(handle, &xmg_fake_ops, fake)) {
+        free(fake);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ *	KEYBOARD SETTINGS
+ */
+int xmg_set_brightness(struct xmg_handle* handle, int brightness) {
+    return xmg_call(handle, XMG_SET_BRIGHTNESS, brightness);
+}
+
+int xmg_set_color(struct xmg_handle* handle, int color) {
+    return xmg_call(handle, XMG_SET_COLOR, color);
+}
+
+int xmg_set_timeout(struct xmg_handle* handle, int timeout) {
+    return xmg_call(handle, XMG_SET_TIMEOUT, timeout);
+}
+
+int xmg_set_boot(struct xmg_handle* handle, int mode) {
+    return xmg_call(handle, XMG_SET_BOOT, mode);
+}
+
+int xmg_set_state(struct xmg_handle* handle, struct xmg_state* state) {
+    return xmg_call(handle, XMG_SET_STATE, (unsigned long)state);
+}
+
+int xmg_set_effect(struct xmg_handle* handle, struct xmg_effect* effect) {
+    return xmg_call(handle, XMG_SET_EFFECT, (unsigned long)effect);
+}
+
+int xmg_set_async(struct xmg_handle* handle, int enable) {
+    return xmg_call(handle, XMG_SET_ASYNC, (unsigned long)!!enable);
+}
+
+int xmg_get_state(struct xmg_handle* handle, struct xmg_state_info* info) {
+    return xmg_call(handle, XMG_GET_STATE, (unsigned long)info);
+}
+
+/*
+ *	RAW DCHU ACCESS
+ */
+int xmg_call_dchu(struct xmg_handle* handle, int cmd, void* buffer, unsigned int* length) {
+    struct xmg_dchu dchu = {
+        .cmd = cmd,
+        .ubuf = buffer,
+        .length = *length,
+    };
+
+    int ret = xmg_call(handle, XMG_CALL_DCHU, (unsigned long)&dchu);
+    *length = dchu.length;
+    return ret;
+}
+
+int xmg_call_dchu_batch(struct xmg_handle* handle, struct xmg_dchu_entry* entries,
+                        unsigned int count, unsigned int flags, unsigned int* completed) {
+    struct xmg_dchu_batch batch = {
+        .count = count,
+        .flags = flags,
+        .entries = entries,
+    };
+
+    int ret = xmg_call(handle, XMG_CALL_DCHU_BATCH, (unsigned long)&batch);
+    if(completed)
+        *completed = batch.completed;
+    return ret;
+}
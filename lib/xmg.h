@@ -0,0 +1,80 @@
+/*
+ *  xmg.h - Userspace library for interacting with xmg_driver
+ */
+#ifndef XMG_H
+#define XMG_H
+
+#include "xmg_uapi.h"
+
+/*
+ * All functions returning int follow the same convention: 0 on success,
+ *  -1 on failure with errno set accordingly.
+ */
+struct xmg_handle;
+
+/*
+ * Backend executing requests on behalf of the handle. `call` receives
+ *  one of XMG_* ioctl codes together with its argument (either value or
+ *  pointer to structure) and returns 0 or negative errno.
+ */
+struct xmg_backend_ops {
+    int  (*call)(void* ctx, unsigned long cmd, unsigned long arg);
+    void (*close)(void* ctx);
+};
+
+// Open real device (path == NULL - use XMG_DEVICE_PATH)
+int xmg_open(struct xmg_handle** handle, const char* path);
+
+// Open in-process fake device - every call sleeps for latency_us
+int xmg_open_fake(struct xmg_handle** handle, unsigned int latency_us);
+
+// Get DCHU command and 32-bit payload of the last packet which the fake
+//  device would send to keyboard controller, together with number of calls
+int xmg_fake_last_call(struct xmg_handle* handle, int* cmd, int* payload, unsigned long* calls);
+
+// Open handle with custom backend
+int xmg_open_backend(struct xmg_handle** handle, const struct xmg_backend_ops* ops, void* ctx);
+
+void xmg_close(struct xmg_handle* handle);
+
+/*
+ *	KEYBOARD SETTINGS
+ */
+int xmg_set_brightness(struct xmg_handle* handle, int brightness);
+int xmg_set_color(struct xmg_handle* handle, int color);
+int xmg_set_timeout(struct xmg_handle* handle, int timeout);
+int xmg_set_boot(struct xmg_handle* handle, int mode);
+
+// Apply all fields selected by state->mask in a single call
+int xmg_set_state(struct xmg_handle* handle, struct xmg_state* state);
+
+int xmg_set_effect(struct xmg_handle* handle, struct xmg_effect* effect);
+
+// Queue set requests of this handle instead of waiting for the keyboard
+//  (asynchronous mode, see driver/README.md)
+int xmg_set_async(struct xmg_handle* handle, int enable);
+
+// Get consistent snapshot of settings remembered by the driver
+int xmg_get_state(struct xmg_handle* handle, struct xmg_state_info* info);
+
+/*
+ *	RAW DCHU ACCESS
+ */
+// Buffer is used for both input and output - on return length contains
+//  size of the output
+int xmg_call_dchu(struct xmg_handle* handle, int cmd, void* buffer, unsigned int* length);
+
+// Execute entries in order - status and output length are stored in each
+//  entry, number of executed entries in completed (may be NULL)
+int xmg_call_dchu_batch(struct xmg_handle* handle, struct xmg_dchu_entry* entries,
+                        unsigned int count, unsigned int flags, unsigned int* completed);
+
+/*
+ *	HELPERS
+ */
+#define XMG_RGB_TO_COLOR(R, G, B)   (((B) & 0xff) << 16 | ((R) & 0xff) << 8 | ((G) & 0xff))
+#define XMG_COLOR_RED(C)            (((C) >> 8) & 0xff)
+#define XMG_COLOR_GREEN(C)          ((C) & 0xff)
+#define XMG_COLOR_BLUE(C)           (((C) >> 16) & 0xff)
+
+#endif
@@ -0,0 +1,318 @@
+/*
+ *  bench.c - Throughput and latency benchmark of xmg_driver ioctls and
+ *          hwmon attributes
+ *
+ *  Every operation is driven from N threads (each with its own handle)
+ *  for a fixed duration. Results are printed as JSON to stdout.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xmg.h"
+#include "xmg_dchu.h"
+
+
+#define MAX_OPS             64
+#define MAX_THREADS         256
+
+/*
+ * Log-linear latency histogram - values below 64ns are exact, larger ones
+ *  are grouped into 32 buckets per power of two (~3% resolution)
+ */
+#define HIST_SUB_BITS       5
+#define HIST_BUCKETS        ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct histogram {
+    uint64_t count[HIST_BUCKETS];
+};
+
+static int hist_index(uint64_t ns) {
+    if(ns < (2u << HIST_SUB_BITS))
+        return ns;
+
+    int shift = 63 - __builtin_clzll(ns) - HIST_SUB_BITS;
+    return (shift << HIST_SUB_BITS) + (ns >> shift);
+}
+
+static uint64_t hist_value(int index) {
+    if(index < (2 << HIST_SUB_BITS))
+        return index;
+
+    int shift = (index >> HIST_SUB_BITS) - 1;
+    return (uint64_t)(index - (shift << HIST_SUB_BITS)) << shift;
+}
+
+static uint64_t hist_percentile(struct histogram* hist, uint64_t total, double percentile) {
+    uint64_t target = total * percentile, seen = 0;
+
+    for(int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->count[i];
+        if(seen > target)
+            return hist_value(i);
+    }
+    return 0;
+}
+
+/*
+ * OPERATIONS
+ */
+enum op_type {
+    OP_BRIGHTNESS,
+    OP_COLOR,
+    OP_TIMEOUT,
+    OP_DCHU,
+    OP_HWMON,
+};
+
+struct op {
+    enum op_type type;
+    char name[64];
+    char path[512];                     // hwmon attribute
+};
+
+struct config {
+    unsigned int threads;
+    unsigned int duration;              // in seconds
+    bool fake;
+    unsigned int fake_latency;          // in microseconds
+};
+
+struct worker {
+    pthread_t thread;
+    struct config* config;
+    struct op* op;
+    volatile bool* stop;
+
+    uint64_t ops;
+    uint64_t errors;
+    struct histogram hist;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Values alternate, so driver can't skip writes as redundant
+static int run_op(struct xmg_handle* xmg, int fd, struct op* op, uint64_t i) {
+    char buffer[64] = {0};
+    unsigned int length;
+
+    switch(op->type) {
+        case OP_BRIGHTNESS:
+            return xmg_set_brightness(xmg, i & 1 ? XMG_MAX_BRIGHTNESS : XMG_MAX_BRIGHTNESS - 1);
+        case OP_COLOR:
+            return xmg_set_color(xmg, i & 1 ? XMG_RGB_TO_COLOR(255, 0, 0) : XMG_RGB_TO_COLOR(0, 0, 255));
+        case OP_TIMEOUT:
+            return xmg_set_timeout(xmg, i & 1 ? 0 : 1);
+        case OP_DCHU:
+            // Read-only command - safe to repeat
+            length = sizeof(buffer);
+            return xmg_call_dchu(xmg, FAN_DCHU_COMMAND_GET, buffer, &length);
+        case OP_HWMON:
+            // Powered down GPU channels report ENODATA - still a served read
+            if(pread(fd, buffer, sizeof(buffer), 0) < 0 && errno != ENODATA)
+                return -1;
+            return 0;
+    }
+    return -1;
+}
+
+static void* worker_main(void* arg) {
+    struct worker* worker = arg;
+    struct xmg_handle* xmg = NULL;
+    int fd = -1, ret = 0;
+
+    if(worker->op->type == OP_HWMON)
+        fd = open(worker->op->path, O_RDONLY | O_CLOEXEC);
+    else if(worker->config->fake)
+        ret = xmg_open_fake(&xmg, worker->config->fake_latency);
+    else
+        ret = xmg_open(&xmg, NULL);
+
+    if(worker->op->type == OP_HWMON ? fd < 0 : ret != 0) {
+        worker->errors++;
+        return NULL;
+    }
+
+    for(uint64_t i = 0; !*worker->stop; i++) {
+        uint64_t start = now_ns();
+        ret = run_op(xmg, fd, worker->op, i);
+        uint64_t latency = now_ns() - start;
+
+        if(ret) {
+            worker->errors++;
+            continue;
+        }
+        worker->ops++;
+        worker->hist.count[hist_index(latency)]++;
+    }
+
+    if(fd >= 0)
+        close(fd);
+    xmg_close(xmg);
+    return NULL;
+}
+
+static void run_benchmark(struct config* config, struct op* op, bool first) {
+    static struct worker workers[MAX_THREADS];
+    static struct histogram total_hist;
+    volatile bool stop = false;
+    uint64_t ops = 0, errors = 0;
+
+    memset(workers, 0, sizeof(workers));
+    memset(&total_hist, 0, sizeof(total_hist));
+
+    uint64_t start = now_ns();
+    for(unsigned int i = 0; i < config->threads; i++) {
+        workers[i].config = config;
+        workers[i].op = op;
+        workers[i].stop = &stop;
+        pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+    }
+
+    sleep(config->duration);
+    stop = true;
+
+    for(unsigned int i = 0; i < config->threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+
+        ops += workers[i].ops;
+        errors += workers[i].errors;
+        for(int j = 0; j < HIST_BUCKETS; j++)
+            total_hist.count[j] += workers[i].hist.count[j];
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    printf("%s\n    {\"op\": \"%s\", \"ops\": %llu, \"errors\": %llu, \"ops_per_sec\": %.1f, "
+           "\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu}",
+        first ? "" : ",", op->name, (unsigned long long)ops, (unsigned long long)errors, ops / elapsed,
+        (unsigned long long)hist_percentile(&total_hist, ops, 0.50),
+        (unsigned long long)hist_percentile(&total_hist, ops, 0.99),
+        (unsigned long long)hist_percentile(&total_hist, ops, 0.999));
+    fflush(stdout);
+}
+
+/*
+ * HWMON DISCOVERY
+ */
+static int find_hwmon(char* path, size_t size) {
+    char name[64];
+    struct dirent* entry;
+    DIR* dir = opendir("/sys/class/hwmon");
+    if(!dir)
+        return -1;
+
+    while((entry = readdir(dir)) != NULL) {
+        if(entry->d_name[0] == '.')
+            continue;
+
+        snprintf(path, size, "/sys/class/hwmon/%s/name", entry->d_name);
+        FILE* file = fopen(path, "r");
+        if(!file)
+            continue;
+
+        bool found = fgets(name, sizeof(name), file) && strcmp(name, "xmg_acpi\n") == 0;
+        fclose(file);
+
+        if(found) {
+            snprintf(path, size, "/sys/class/hwmon/%s", entry->d_name);
+            closedir(dir);
+            return 0;
+        }
+    }
+
+    closedir(dir);
+    return -1;
+}
+
+static int add_hwmon_ops(const char* hwmon, struct op* ops, int count) {
+    static const char* PATTERNS[] = { "temp*", "fan*", "pwm*", "update_interval" };
+    struct dirent** entries;
+
+    int n = scandir(hwmon, &entries, NULL, alphasort);
+    if(n < 0)
+        return count;
+
+    for(int i = 0; i < n; i++) {
+        for(int j = 0; j < sizeof(PATTERNS) / sizeof(PATTERNS[0]) && count < MAX_OPS; j++) {
+            if(fnmatch(PATTERNS[j], entries[i]->d_name, 0))
+                continue;
+
+            ops[count].type = OP_HWMON;
+            snprintf(ops[count].name, sizeof(ops[count].name), "hwmon/%s", entries[i]->d_name);
+            snprintf(ops[count].path, sizeof(ops[count].path), "%s/%s", hwmon, entries[i]->d_name);
+            count++;
+            break;
+        }
+        free(entries[i]);
+    }
+
+    free(entries);
+    return count;
+}
+
+static void usage(const char* name) {
+    fprintf(stderr,
+        "Usage: %s [-t threads] [-d seconds] [-f latency_us] [-H hwmon_dir] [-n]\n"
+        "  -t  number of threads per operation (default: 1)\n"
+        "  -d  duration of each operation in seconds (default: 5)\n"
+        "  -f  use in-process fake device with given latency instead of %s\n"
+        "  -H  hwmon directory (default: autodetected xmg_acpi device)\n"
+        "  -n  skip hwmon attributes\n", name, XMG_DEVICE_PATH);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    static struct op ops[MAX_OPS] = {
+        { .type = OP_BRIGHTNESS, .name = "XMG_SET_BRIGHTNESS" },
+        { .type = OP_COLOR, .name = "XMG_SET_COLOR" },
+        { .type = OP_TIMEOUT, .name = "XMG_SET_TIMEOUT" },
+        { .type = OP_DCHU, .name = "XMG_CALL_DCHU" },
+    };
+    struct config config = { .threads = 1, .duration = 5 };
+    char hwmon[256] = {0};
+    bool use_hwmon = true;
+    int count = 4, opt;
+
+    while((opt = getopt(argc, argv, "t:d:f:H:n")) != -1) {
+        switch(opt) {
+            case 't': config.threads = atoi(optarg); break;
+            case 'd': config.duration = atoi(optarg); break;
+            case 'f': config.fake = true; config.fake_latency = atoi(optarg); break;
+            case 'H': snprintf(hwmon, sizeof(hwmon), "%s", optarg); break;
+            case 'n': use_hwmon = false; break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if(!config.threads || config.threads > MAX_THREADS || !config.duration)
+        usage(argv[0]);
+
+    // Fake device has no hwmon - use it only if explicitly provided
+    if(use_hwmon && !hwmon[0] && (config.fake || find_hwmon(hwmon, sizeof(hwmon))))
+        use_hwmon = false;
+    if(use_hwmon)
+        count = add_hwmon_ops(hwmon, ops, count);
+
+    printf("{\n  \"device\": \"%s\",\n  \"threads\": %u,\n  \"duration_s\": %u,\n  \"results\": [",
+        config.fake ? "fake" : XMG_DEVICE_PATH, config.threads, config.duration);
+
+    for(int i = 0; i < count; i++)
+        run_benchmark(&config, &ops[i], i == 0);
+
+    printf("\n  ]\n}\n");
+    return 0;
+}
@@ -1,12 +1,10 @@
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/ioctl.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
-#define XMG_MAGIC_CODE      'X'
-#define XMG_SET_BOOT        _IOW(XMG_MAGIC_CODE, 0x03, int)
+#include "xmg.h"
 
 int main(int argc, char** argv) {
 	if(argc < 2) {
@@ -16,17 +14,17 @@ int main(int argc, char** argv) {
 
 	int mode = !!atoi(argv[1]);
 
-	int fd = open("/dev/xmg_driver", 0);
-	if(fd < 0) {
+	struct xmg_handle* xmg;
+	if(xmg_open(&xmg, NULL)) {
 		perror("open");
 		exit(1);
 	}
 
-	int ret = ioctl(fd, XMG_SET_BOOT, mode);
+	int ret = xmg_set_boot(xmg, mode);
 	if(ret < 0) {
 		perror("ioctl");
 		exit(1);
 	}
 
-	close(fd);
+	xmg_close(xmg);
 }
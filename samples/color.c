@@ -1,12 +1,10 @@
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/ioctl.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
-#define XMG_MAGIC_CODE      'X'
-#define XMG_SET_COLOR       _IOW(XMG_MAGIC_CODE, 0x01, int)
+#include "xmg.h"
 
 int main(int argc, char** argv) {
 	if(argc < 4) {
@@ -17,19 +15,19 @@ int main(int argc, char** argv) {
 	int red = atoi(argv[1]);
     int green = atoi(argv[2]);
     int blue = atoi(argv[3]);
-    int color = blue << 16 | red << 8 | green;
+    int color = XMG_RGB_TO_COLOR(red, green, blue);
 
-	int fd = open("/dev/xmg_driver", 0);
-	if(fd < 0) {
+	struct xmg_handle* xmg;
+	if(xmg_open(&xmg, NULL)) {
 		perror("open");
 		exit(1);
 	}
 
-	int ret = ioctl(fd, XMG_SET_COLOR, color);
+	int ret = xmg_set_color(xmg, color);
 	if(ret < 0) {
 		perror("ioctl");
 		exit(1);
 	}
 
-	close(fd);
+	xmg_close(xmg);
 }
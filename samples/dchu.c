@@ -1,23 +1,14 @@
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/ioctl.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
-struct xmg_dchu {
-    int             cmd;
-    char*           ubuf;
-    int             length;
-};
-
-#define XMG_MAGIC_CODE      'X'
-#define XMG_CALL_DCHU       _IOWR(XMG_MAGIC_CODE, 0x10, struct xmg_dchu*)
-
+#include "xmg.h"
 
 
 int main(int argc, char** argv) {
-    char buffer[4096];
+    char buffer[XMG_MAX_DCHU_LENGTH];
 
 	if(argc < 2) {
 		fprintf(stderr, "Usage: %s <cmd>", argv[0]);
@@ -25,25 +16,24 @@ int main(int argc, char** argv) {
 	}
 
 	int cmd = atoi(argv[1]);
-    size_t len = read(0, buffer, 4096);
-
-    struct xmg_dchu dchu = {
-        .cmd = cmd,
-        .length = len,
-        .ubuf = buffer
-    };
+    ssize_t len = read(0, buffer, sizeof(buffer));
+	if(len <= 0) {
+		perror("read");
+		exit(1);
+	}
 
-	int fd = open("/dev/xmg_driver", 0);
-	if(fd < 0) {
+	struct xmg_handle* xmg;
+	if(xmg_open(&xmg, NULL)) {
 		perror("open");
 		exit(1);
 	}
 
-	int ret = ioctl(fd, XMG_CALL_DCHU, &dchu);
+	unsigned int length = len;
+	int ret = xmg_call_dchu(xmg, cmd, buffer, &length);
 	if(ret < 0) {
 		perror("ioctl");
 		exit(1);
 	}
 
-	close(fd);
+	xmg_close(xmg);
 }